@@ -5,6 +5,7 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "roflibs/netlink/cpacketpool.hpp"
 #include "roflibs/netlink/nbi_impl.hpp"
 #include "roflibs/netlink/tap_manager.hpp"
 #include "roflibs/of-dpa/cbasebox.hpp"
@@ -17,7 +18,63 @@ static bool validate_port(const char *flagname, gflags::int32 value) {
   return false;
 }
 
+static bool validate_pool_size(const char *flagname, gflags::int32 value) {
+  if (value > 0) // value is ok
+    return true;
+  return false;
+}
+
+static bool validate_non_negative(const char *flagname, gflags::int32 value) {
+  if (value >= 0) // value is ok
+    return true;
+  return false;
+}
+
 DEFINE_int32(port, 6653, "Listening port");
+DEFINE_int32(pool_initial_pkts, 256,
+             "Number of packet buffers allocated at startup");
+DEFINE_int32(pool_max_pkts, 4096,
+             "Maximum number of packet buffers the pool may grow to");
+DEFINE_int32(pool_slab_pkts, 64,
+             "Number of packet buffers added to the pool at once");
+DEFINE_int32(tap_tx_queue_len, 256,
+             "Maximum number of packets queued for writing per tap and "
+             "traffic class");
+DEFINE_bool(tap_tx_drop_oldest, false,
+            "Drop the oldest instead of the newest packet if a tap's queue is "
+            "full");
+DEFINE_int32(tap_queues, 1, "Number of queues per tap");
+DEFINE_int32(tap_threads, 1,
+             "Number of threads serving the taps, at least one per tap queue");
+DEFINE_bool(tap_io_uring, false,
+            "Use io_uring for tap I/O, falls back to read()/write() if "
+            "unavailable");
+DEFINE_bool(tap_vnet_hdr, false,
+            "Let the host hand over frames with incomplete checksums and TCP "
+            "GSO frames to the taps, both are finished before packet-out");
+DEFINE_bool(tap_tpacket, false,
+            "Receive frames from the taps through a TPACKET_V3 ring instead of "
+            "reading the tap fds");
+DEFINE_bool(tap_vhost, false,
+            "Move frames between the taps and the packet pool through "
+            "vhost-net, falls back to read()/write() if unavailable");
+DEFINE_int32(punt_rate_control, 0,
+             "Packet-ins per second and port of control protocols (STP, "
+             "LACP, LLDP, routing keepalives) injected into the taps, 0 "
+             "disables the limit");
+DEFINE_int32(punt_burst_control, 200,
+             "Burst of control packet-ins per port above punt_rate_control");
+DEFINE_int32(punt_rate_bulk, 0,
+             "Packet-ins per second and port of all other traffic injected "
+             "into the taps, 0 disables the limit");
+DEFINE_int32(punt_burst_bulk, 500,
+             "Burst of other packet-ins per port above punt_rate_bulk");
+DEFINE_int32(packet_in_workers, 1,
+             "Number of threads running slow path packet-in handlers, 0 runs "
+             "them on the OpenFlow thread");
+DEFINE_int32(pool_stats_interval, 60,
+             "Interval in seconds for logging packet pool statistics, 0 "
+             "disables logging");
 
 static void int_sig_handler(int sig) { got_SIGINT = 1; }
 
@@ -29,6 +86,35 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  if (!gflags::RegisterFlagValidator(&FLAGS_pool_initial_pkts,
+                                     &validate_pool_size) ||
+      !gflags::RegisterFlagValidator(&FLAGS_pool_max_pkts,
+                                     &validate_pool_size) ||
+      !gflags::RegisterFlagValidator(&FLAGS_pool_slab_pkts,
+                                     &validate_pool_size) ||
+      !gflags::RegisterFlagValidator(&FLAGS_tap_tx_queue_len,
+                                     &validate_pool_size) ||
+      !gflags::RegisterFlagValidator(&FLAGS_tap_queues, &validate_pool_size) ||
+      !gflags::RegisterFlagValidator(&FLAGS_tap_threads,
+                                     &validate_pool_size)) {
+    std::cerr << "Failed to register size validators" << std::endl;
+    exit(1);
+  }
+
+  if (!gflags::RegisterFlagValidator(&FLAGS_punt_rate_control,
+                                     &validate_non_negative) ||
+      !gflags::RegisterFlagValidator(&FLAGS_punt_burst_control,
+                                     &validate_non_negative) ||
+      !gflags::RegisterFlagValidator(&FLAGS_punt_rate_bulk,
+                                     &validate_non_negative) ||
+      !gflags::RegisterFlagValidator(&FLAGS_punt_burst_bulk,
+                                     &validate_non_negative) ||
+      !gflags::RegisterFlagValidator(&FLAGS_packet_in_workers,
+                                     &validate_non_negative)) {
+    std::cerr << "Failed to register rate and worker validators" << std::endl;
+    exit(1);
+  }
+
   gflags::SetUsageMessage("");
   gflags::SetVersionString(PACKAGE_VERSION);
 
@@ -58,13 +144,34 @@ int main(int argc, char **argv) {
 
   sigemptyset(&sigset);
 
-  rofcore::nbi_impl *nbi = new rofcore::nbi_impl();
+  rofcore::cpacketpool::configure(FLAGS_pool_initial_pkts, FLAGS_pool_max_pkts,
+                                  FLAGS_pool_slab_pkts);
+
+  rofcore::tap_config tap_cfg;
+  tap_cfg.tx_queue_len = FLAGS_tap_tx_queue_len;
+  tap_cfg.tx_drop_oldest = FLAGS_tap_tx_drop_oldest;
+  tap_cfg.n_queues = FLAGS_tap_queues;
+  tap_cfg.n_threads = FLAGS_tap_threads;
+  tap_cfg.io_uring = FLAGS_tap_io_uring;
+  tap_cfg.vnet_hdr = FLAGS_tap_vnet_hdr;
+  tap_cfg.tpacket = FLAGS_tap_tpacket;
+  tap_cfg.vhost = FLAGS_tap_vhost;
+
+  basebox::punt_policer_config policer_cfg;
+  policer_cfg.rate[rofcore::PKT_CLASS_CONTROL] = FLAGS_punt_rate_control;
+  policer_cfg.burst[rofcore::PKT_CLASS_CONTROL] = FLAGS_punt_burst_control;
+  policer_cfg.rate[rofcore::PKT_CLASS_BULK] = FLAGS_punt_rate_bulk;
+  policer_cfg.burst[rofcore::PKT_CLASS_BULK] = FLAGS_punt_burst_bulk;
+
+  rofcore::nbi_impl *nbi = new rofcore::nbi_impl(tap_cfg);
   std::unique_ptr<basebox::cbasebox> box(
-      new basebox::cbasebox(nbi, versionbitmap));
+      new basebox::cbasebox(nbi, versionbitmap, policer_cfg,
+                            FLAGS_packet_in_workers));
 
   rofl::csockaddr baddr(AF_INET, std::string("0.0.0.0"), FLAGS_port);
   box->dpt_sock_listen(baddr);
 
+  time_t last_stats = time(nullptr);
   while (running) {
     try {
       // Launch main I/O loop
@@ -79,6 +186,28 @@ int main(int argc, char **argv) {
         LOG(INFO) << "received SIGINT, shutting down";
       }
 
+      // return idle packet buffers grown during bursts
+      rofcore::cpacketpool::get_instance().shrink();
+
+      if (FLAGS_pool_stats_interval > 0 &&
+          time(nullptr) - last_stats >= FLAGS_pool_stats_interval) {
+        last_stats = time(nullptr);
+        LOG(INFO) << "packet pool: "
+                  << rofcore::cpacketpool::get_instance().get_stats();
+        LOG(INFO) << "punt policer: " << box->get_punt_stats();
+        LOG(INFO) << "packet-in workers: dropped="
+                  << box->get_packet_in_dropped();
+
+        std::map<uint32_t, rofcore::tap_io::tx_stats> tx_stats;
+        nbi->get_tx_stats(tx_stats);
+        for (auto &s : tx_stats) {
+          LOG(INFO) << "tap tx port_id=" << s.first << ": " << s.second;
+        }
+        rofcore::tap_io::rx_stats rx_stats;
+        nbi->get_rx_stats(rx_stats);
+        LOG(INFO) << "tap rx: " << rx_stats;
+      }
+
     } catch (std::exception &e) {
       std::cerr << "exception caught, what: " << e.what() << std::endl;
     }
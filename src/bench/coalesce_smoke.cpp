@@ -0,0 +1,204 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Smoke test of merging flood copies in tap_io: the host sends the same frame
+// to two scratch taps that become readable in the same poll round, tap_io has
+// to hand it to the switch once for both ports. Needs CAP_NET_ADMIN.
+//
+// usage: coalesce_smoke
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "roflibs/netlink/tap_manager.hpp"
+
+using namespace rofcore;
+
+namespace {
+
+const int timeout_ms = 1000;
+
+int open_tap(std::string &name) {
+  int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open /dev/net/tun");
+    return -1;
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  strncpy(ifr.ifr_name, "bbsmoke%d", IFNAMSIZ - 1);
+  if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+    perror("TUNSETIFF");
+    close(fd);
+    return -1;
+  }
+  name = ifr.ifr_name;
+
+  int sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sd < 0 || ioctl(sd, SIOCGIFFLAGS, &ifr) < 0 ||
+      (ifr.ifr_flags |= IFF_UP, ioctl(sd, SIOCSIFFLAGS, &ifr) < 0)) {
+    perror("setting the tap up");
+    if (sd >= 0)
+      close(sd);
+    close(fd);
+    return -1;
+  }
+  close(sd);
+  return fd;
+}
+
+// frames with this marker block the tap_io thread until released
+const uint8_t marker_gate = 0x01;
+const uint8_t marker_flood = 0x02;
+
+// frame with the marker sent by the host
+bool is_test_frame(const packet &pkt, uint8_t marker) {
+  return pkt.length() > ETH_HLEN && pkt.soframe()[12] == 0x88 &&
+         pkt.soframe()[13] == 0xb5 && pkt.soframe()[ETH_HLEN] == marker;
+}
+
+class recording_switch : public switch_callback {
+public:
+  recording_switch()
+      : gate_blocked(false), gate_open(false), n_single(0), n_flood(0),
+        n_flood_ports(0) {}
+
+  int enqueue_to_switch(uint32_t port_id, packet_ptr pkt) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (is_test_frame(*pkt, marker_gate)) {
+      gate_blocked = true;
+      cv.notify_all();
+      cv.wait(lock, [this]() { return gate_open; });
+    } else if (is_test_frame(*pkt, marker_flood)) {
+      n_single++;
+      cv.notify_all();
+    }
+    return 0;
+  }
+
+  int flood_to_switch(const std::vector<uint32_t> &port_ids,
+                      packet_ptr pkt) override {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (is_test_frame(*pkt, marker_flood)) {
+      n_flood++;
+      n_flood_ports += port_ids.size();
+      cv.notify_all();
+    }
+    return 0;
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool gate_blocked;
+  bool gate_open;
+  unsigned int n_single;      // copies sent separately
+  unsigned int n_flood;       // merged copies
+  unsigned int n_flood_ports; // ports of the merged copies
+};
+
+bool send_frame(const std::string &name, uint8_t marker) {
+  int sd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (sd < 0) {
+    perror("socket AF_PACKET");
+    return false;
+  }
+
+  struct sockaddr_ll sll;
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_ifindex = if_nametoindex(name.c_str());
+  sll.sll_halen = ETH_ALEN;
+
+  // broadcast with a local experimental ethertype
+  std::vector<uint8_t> frame(ETH_ZLEN, 0);
+  memset(frame.data(), 0xff, ETH_ALEN);
+  frame[ETH_ALEN] = 0x02;
+  frame[12] = 0x88;
+  frame[13] = 0xb5;
+  frame[ETH_HLEN] = marker;
+
+  bool ok = sendto(sd, frame.data(), frame.size(), 0, (struct sockaddr *)&sll,
+                   sizeof(sll)) == (ssize_t)frame.size();
+  if (not ok)
+    perror("sendto");
+  close(sd);
+  return ok;
+}
+
+bool run(recording_switch &sw, const std::string names[2]) {
+  auto timeout = std::chrono::milliseconds(timeout_ms);
+  std::unique_lock<std::mutex> lock(sw.mutex);
+
+  // keep the tap_io thread busy until the copies are queued on both taps
+  if (not send_frame(names[0], marker_gate) ||
+      not sw.cv.wait_for(lock, timeout, [&sw]() { return sw.gate_blocked; })) {
+    fprintf(stderr, "gate frame not received\n");
+    sw.gate_open = true;
+    sw.cv.notify_all();
+    return false;
+  }
+  bool sent = send_frame(names[0], marker_flood) &&
+              send_frame(names[1], marker_flood);
+  sw.gate_open = true;
+  sw.cv.notify_all();
+  if (not sent) {
+    return false;
+  }
+
+  sw.cv.wait_for(lock, timeout, [&sw]() {
+    return sw.n_single + sw.n_flood_ports >= 2;
+  });
+  return sw.n_single == 0 && sw.n_flood == 1 && sw.n_flood_ports == 2;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string names[2];
+  int tap_fds[2];
+  for (int i = 0; i < 2; i++) {
+    tap_fds[i] = open_tap(names[i]);
+    if (tap_fds[i] < 0) {
+      return 1;
+    }
+  }
+
+  recording_switch sw;
+  bool ok;
+  {
+    tap_io io((tap_config()));
+    for (int i = 0; i < 2; i++)
+      io.register_tap(tap_fds[i], i + 1, sw);
+
+    // the taps are polled once the tap_io thread picked them up
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ok = run(sw, names);
+    for (int i = 0; i < 2; i++)
+      io.unregister_tap(tap_fds[i], i + 1);
+  }
+
+  for (int i = 0; i < 2; i++)
+    close(tap_fds[i]);
+  printf("%s: %u merged copies to %u ports, %u sent separately\n",
+         ok ? "PASS" : "FAIL", sw.n_flood, sw.n_flood_ports, sw.n_single);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Contention of the packet pool free list: the rwlock protected deque used
+// by cpacketpool before and the mpmc_ring replacing it. Every thread
+// acquires a buffer index and releases it again, as the rofl, tap_io and
+// packet-out threads do for every punted frame.
+//
+// usage: pool_ring_bench [max_threads] [ops_per_thread]
+
+#include <pthread.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "roflibs/netlink/mpmc_ring.hpp"
+
+namespace {
+
+const unsigned int n_bufs = 4096;
+
+class locked_deque {
+public:
+  locked_deque() { pthread_rwlock_init(&lock, nullptr); }
+  ~locked_deque() { pthread_rwlock_destroy(&lock); }
+
+  // both sides took the lock in write mode
+  bool push(uint32_t idx) {
+    pthread_rwlock_wrlock(&lock);
+    bufs.push_back(idx);
+    pthread_rwlock_unlock(&lock);
+    return true;
+  }
+
+  bool pop(uint32_t &idx) {
+    pthread_rwlock_wrlock(&lock);
+    bool found = not bufs.empty();
+    if (found) {
+      idx = bufs.front();
+      bufs.pop_front();
+    }
+    pthread_rwlock_unlock(&lock);
+    return found;
+  }
+
+private:
+  pthread_rwlock_t lock;
+  std::deque<uint32_t> bufs;
+};
+
+template <typename Q> double run(Q &q, unsigned int n_threads, long n_ops) {
+  for (uint32_t i = 0; i < n_bufs; i++) {
+    q.push(i);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned int t = 0; t < n_threads; t++) {
+    threads.emplace_back([&q, n_ops]() {
+      uint32_t idx;
+      for (long i = 0; i < n_ops; i++) {
+        while (not q.pop(idx)) {
+        }
+        q.push(idx);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  return n_threads * n_ops / elapsed.count();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+  long n_ops = argc > 2 ? atol(argv[2]) : 1000000;
+
+  printf("%8s %20s %20s\n", "threads", "rwlock+deque ops/s", "mpmc_ring ops/s");
+  for (unsigned int n = 1; n <= max_threads; n *= 2) {
+    locked_deque deque;
+    rofcore::mpmc_ring<uint32_t> ring(n_bufs);
+    double d = run(deque, n, n_ops);
+    double r = run(ring, n, n_ops);
+    printf("%8u %20.0f %20.0f\n", n, d, r);
+  }
+  return 0;
+}
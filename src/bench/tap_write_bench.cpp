@@ -0,0 +1,192 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Frames written to a scratch tap through tap_io by several producer threads,
+// as packet-outs are. pool enqueues pool packets, which go through the
+// producer rings and are written by the tap_io thread. direct enqueues frames
+// owned by the caller, written right away on the producer thread unless
+// packets are pending for the tap. Producers keep at most max_in_flight pool
+// packets queued, frames dropped by tap_io are not counted as written. With
+// io_uring all writes, including direct ones, are submitted through the ring,
+// the row is left out in case io_uring is unavailable. Needs CAP_NET_ADMIN.
+//
+// usage: tap_write_bench [n_producers] [frames_per_producer] [frame_len]
+
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "roflibs/netlink/tap_manager.hpp"
+
+using namespace rofcore;
+
+namespace {
+
+// pool packets queued at once over all producers, below the tx queue limit
+const int64_t max_in_flight = 1024;
+
+int open_tap() {
+  int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open /dev/net/tun");
+    return -1;
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  strncpy(ifr.ifr_name, "bbbench%d", IFNAMSIZ - 1);
+  if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+    perror("TUNSETIFF");
+    close(fd);
+    return -1;
+  }
+
+  // writes to a tap that is down fail with EIO
+  int sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sd < 0 || ioctl(sd, SIOCGIFFLAGS, &ifr) < 0 ||
+      (ifr.ifr_flags |= IFF_UP, ioctl(sd, SIOCSIFFLAGS, &ifr) < 0)) {
+    perror("setting the tap up");
+    if (sd >= 0)
+      close(sd);
+    close(fd);
+    return -1;
+  }
+  close(sd);
+  return fd;
+}
+
+// never receives, the bench only writes
+class null_switch : public switch_callback {
+public:
+  int enqueue_to_switch(uint32_t port_id, packet_ptr pkt) override {
+    return 0;
+  }
+  int flood_to_switch(const std::vector<uint32_t> &port_ids,
+                      packet_ptr pkt) override {
+    return 0;
+  }
+};
+
+// wait until less than max pool packets are held beyond base
+void throttle(int64_t base, int64_t max) {
+  while (cpacketpool::get_instance().get_stats().in_use - base >= max) {
+    std::this_thread::yield();
+  }
+}
+
+void produce_pool(tap_io &io, int fd, long n_frames, int64_t base,
+                  const std::vector<uint8_t> &frame) {
+  cpacketpool &pool = cpacketpool::get_instance();
+  for (long i = 0; i < n_frames; i++) {
+    throttle(base, max_in_flight);
+    packet_ptr pkt = pool.try_acquire_pkt(frame.size());
+    if (pkt == nullptr) {
+      i--;
+      std::this_thread::yield();
+      continue;
+    }
+    pkt->unpack(frame.data(), frame.size());
+    io.enqueue(fd, std::move(pkt));
+  }
+}
+
+void produce_direct(tap_io &io, int fd, long n_frames, int64_t base,
+                    const std::vector<uint8_t> &frame) {
+  for (long i = 0; i < n_frames; i++) {
+    throttle(base, max_in_flight);
+    io.enqueue(fd, frame.data(), frame.size());
+  }
+}
+
+// frames written per second
+double run(bool io_uring, bool direct, int tap_fd, unsigned int n_producers,
+           long n_frames, const std::vector<uint8_t> &frame) {
+  tap_config cfg;
+  cfg.io_uring = io_uring;
+  cfg.tx_queue_len = 2 * max_in_flight;
+  null_switch sw;
+  tap_io io(cfg);
+  io.register_tap(tap_fd, 1, sw);
+  // with io_uring the tap_io thread posts reads holding pool packets
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  int64_t base = cpacketpool::get_instance().get_stats().in_use;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> producers;
+  for (unsigned int p = 0; p < n_producers; p++) {
+    producers.emplace_back(direct ? produce_direct : produce_pool,
+                           std::ref(io), tap_fd, n_frames, base,
+                           std::cref(frame));
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+  // every packet left the pool for a tap or was dropped
+  throttle(base, 1);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  tap_io::tx_stats stats;
+  long n_dropped = 0;
+  if (io.get_tx_stats(tap_fd, stats)) {
+    n_dropped = stats.dropped_full + stats.dropped_ring +
+                stats.dropped_link_down + stats.dropped_error;
+  }
+  io.unregister_tap(tap_fd, 1);
+
+  return (n_producers * n_frames - n_dropped) / elapsed.count();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned int n_producers = argc > 1 ? atoi(argv[1]) : 2;
+  long n_frames = argc > 2 ? atol(argv[2]) : 200000;
+  size_t len = argc > 3 ? atoi(argv[3]) : 64;
+  if (len < ETH_ZLEN || len > ETH_FRAME_LEN) {
+    fprintf(stderr, "frame_len must be in [%d, %d]\n", ETH_ZLEN,
+            ETH_FRAME_LEN);
+    return 1;
+  }
+
+  int tap_fd = open_tap();
+  if (tap_fd < 0) {
+    return 1;
+  }
+
+  // broadcast with a local experimental ethertype, dropped by the host
+  std::vector<uint8_t> frame(len, 0);
+  memset(frame.data(), 0xff, ETH_ALEN);
+  frame[ETH_ALEN] = 0x02;
+  frame[12] = 0x88;
+  frame[13] = 0xb5;
+
+  printf("%10s %10s %20s %20s\n", "backend", "producers", "pool frames/s",
+         "direct frames/s");
+  for (bool io_uring : {false, true}) {
+    if (io_uring && not tap_uring::create(8)) {
+      continue;
+    }
+    double p = run(io_uring, false, tap_fd, n_producers, n_frames, frame);
+    double d = run(io_uring, true, tap_fd, n_producers, n_frames, frame);
+    printf("%10s %10u %20.0f %20.0f\n", io_uring ? "io_uring" : "write",
+           n_producers, p, d);
+  }
+
+  close(tap_fd);
+  return 0;
+}
@@ -0,0 +1,201 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Frames sent by the host to a tap, received by read() from the tap fd and
+// from the TPACKET_V3 ring of tap_tpacket. A thread sends frames through a
+// packet socket bound to a scratch tap, the main thread receives them the way
+// tap_io does. Needs CAP_NET_ADMIN.
+//
+// usage: tpacket_bench [n_frames] [frame_len]
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "roflibs/netlink/tap_tpacket.hpp"
+
+namespace {
+
+// frames still missing after this long are counted as lost
+const int idle_timeout_ms = 200;
+
+int open_tap(std::string &name) {
+  int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open /dev/net/tun");
+    return -1;
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  strncpy(ifr.ifr_name, "bbbench%d", IFNAMSIZ - 1);
+  if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+    perror("TUNSETIFF");
+    close(fd);
+    return -1;
+  }
+  name = ifr.ifr_name;
+
+  int sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sd < 0 || ioctl(sd, SIOCGIFFLAGS, &ifr) < 0 ||
+      (ifr.ifr_flags |= IFF_UP, ioctl(sd, SIOCSIFFLAGS, &ifr) < 0)) {
+    perror("setting the tap up");
+    if (sd >= 0)
+      close(sd);
+    close(fd);
+    return -1;
+  }
+  close(sd);
+  return fd;
+}
+
+// send n_frames through the host side of the tap
+void send_frames(const std::string &name, long n_frames, size_t len,
+                 std::atomic<bool> &done) {
+  int sd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (sd < 0) {
+    perror("socket AF_PACKET");
+    done = true;
+    return;
+  }
+
+  struct sockaddr_ll sll;
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_ifindex = if_nametoindex(name.c_str());
+  sll.sll_halen = ETH_ALEN;
+
+  std::vector<uint8_t> frame(len, 0);
+  memset(frame.data(), 0xff, ETH_ALEN);
+  frame[ETH_ALEN] = 0x02;
+  frame[12] = 0x88; // local experimental ethertype
+  frame[13] = 0xb5;
+
+  for (long i = 0; i < n_frames; i++) {
+    while (sendto(sd, frame.data(), len, 0, (struct sockaddr *)&sll,
+                  sizeof(sll)) < 0) {
+      if (errno != ENOBUFS && errno != EAGAIN) {
+        perror("sendto");
+        close(sd);
+        done = true;
+        return;
+      }
+      std::this_thread::yield();
+    }
+  }
+  close(sd);
+  done = true;
+}
+
+// receive until the sender is done and no frame arrived for idle_timeout_ms
+template <typename F>
+long receive(int poll_fd, std::atomic<bool> &done, F read_frame) {
+  uint8_t buf[ETH_FRAME_LEN + 64];
+  long n = 0;
+
+  struct pollfd pfd = {poll_fd, POLLIN, 0};
+  for (;;) {
+    int rv = poll(&pfd, 1, idle_timeout_ms);
+    if (rv < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+    if (rv == 0 && done) {
+      break;
+    }
+    // the host sends e.g. router solicitations to a new interface, too
+    while (read_frame(buf, sizeof(buf)) > 0) {
+      if (buf[12] == 0x88 && buf[13] == 0xb5)
+        n++;
+    }
+  }
+  return n;
+}
+
+void report(const char *mode, long n_frames, long n_rx,
+            std::chrono::steady_clock::time_point start) {
+  // the idle timeout at the end is not part of the receive time
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start -
+      std::chrono::milliseconds(idle_timeout_ms);
+  printf("%8s %12ld %12ld %16.0f\n", mode, n_frames, n_rx,
+         n_rx / elapsed.count());
+}
+
+bool run(bool tpacket, long n_frames, size_t len) {
+  std::string name;
+  int tap_fd = open_tap(name);
+  if (tap_fd < 0) {
+    return false;
+  }
+
+  std::unique_ptr<rofcore::tap_tpacket> ring;
+  if (tpacket) {
+    ring = rofcore::tap_tpacket::create(name, tap_fd);
+    if (not ring) {
+      fprintf(stderr, "failed to attach a ring to %s\n", name.c_str());
+      close(tap_fd);
+      return false;
+    }
+  }
+
+  std::atomic<bool> done(false);
+  auto start = std::chrono::steady_clock::now();
+  std::thread sender(send_frames, name, n_frames, len, std::ref(done));
+
+  long n_rx;
+  if (tpacket) {
+    rofcore::tap_tpacket *r = ring.get();
+    n_rx = receive(r->get_fd(), done, [r](uint8_t *buf, size_t size) {
+      return r->read(buf, size);
+    });
+  } else {
+    n_rx = receive(tap_fd, done, [tap_fd](uint8_t *buf, size_t size) {
+      return read(tap_fd, buf, size);
+    });
+  }
+  sender.join();
+  report(tpacket ? "tpacket" : "read", n_frames, n_rx, start);
+
+  ring.reset();
+  close(tap_fd);
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  long n_frames = argc > 1 ? atol(argv[1]) : 200000;
+  size_t len = argc > 2 ? atoi(argv[2]) : 64;
+  if (len < ETH_ZLEN || len > ETH_FRAME_LEN) {
+    fprintf(stderr, "frame_len must be in [%d, %d]\n", ETH_ZLEN,
+            ETH_FRAME_LEN);
+    return 1;
+  }
+
+  printf("%8s %12s %12s %16s\n", "mode", "sent", "received", "frames/s");
+  if (not run(false, n_frames, len) || not run(true, n_frames, len)) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,172 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Smoke test of tap_io with io_uring on a scratch tap: frames sent by the host
+// have to be read by the reads posted to the ring and handed to the switch.
+// Needs CAP_NET_ADMIN, exits with 77 (skipped) without io_uring support.
+//
+// usage: uring_smoke [n_frames]
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "roflibs/netlink/tap_manager.hpp"
+
+using namespace rofcore;
+
+namespace {
+
+const int exit_skip = 77;
+const int timeout_ms = 1000;
+
+int open_tap(std::string &name) {
+  int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open /dev/net/tun");
+    return -1;
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  strncpy(ifr.ifr_name, "bbsmoke%d", IFNAMSIZ - 1);
+  if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+    perror("TUNSETIFF");
+    close(fd);
+    return -1;
+  }
+  name = ifr.ifr_name;
+
+  int sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sd < 0 || ioctl(sd, SIOCGIFFLAGS, &ifr) < 0 ||
+      (ifr.ifr_flags |= IFF_UP, ioctl(sd, SIOCSIFFLAGS, &ifr) < 0)) {
+    perror("setting the tap up");
+    if (sd >= 0)
+      close(sd);
+    close(fd);
+    return -1;
+  }
+  close(sd);
+  return fd;
+}
+
+// counts the test frames handed to the switch
+class counting_switch : public switch_callback {
+  // the host sends e.g. router solicitations to a new interface, too
+  static bool is_test_frame(const packet &pkt) {
+    return pkt.length() >= ETH_HLEN && pkt.soframe()[12] == 0x88 &&
+           pkt.soframe()[13] == 0xb5;
+  }
+
+public:
+  counting_switch() : n_frames(0) {}
+
+  int enqueue_to_switch(uint32_t port_id, packet_ptr pkt) override {
+    if (is_test_frame(*pkt))
+      n_frames++;
+    return 0;
+  }
+
+  int flood_to_switch(const std::vector<uint32_t> &port_ids,
+                      packet_ptr pkt) override {
+    if (is_test_frame(*pkt))
+      n_frames += port_ids.size();
+    return 0;
+  }
+
+  std::atomic<long> n_frames;
+};
+
+bool send_frames(const std::string &name, long n_frames) {
+  int sd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (sd < 0) {
+    perror("socket AF_PACKET");
+    return false;
+  }
+
+  struct sockaddr_ll sll;
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_ifindex = if_nametoindex(name.c_str());
+  sll.sll_halen = ETH_ALEN;
+
+  // broadcast with a local experimental ethertype
+  std::vector<uint8_t> frame(ETH_ZLEN, 0);
+  memset(frame.data(), 0xff, ETH_ALEN);
+  frame[ETH_ALEN] = 0x02;
+  frame[12] = 0x88;
+  frame[13] = 0xb5;
+
+  for (long i = 0; i < n_frames; i++) {
+    frame[ETH_HLEN] = i;
+    if (sendto(sd, frame.data(), frame.size(), 0, (struct sockaddr *)&sll,
+               sizeof(sll)) < 0) {
+      perror("sendto");
+      close(sd);
+      return false;
+    }
+  }
+  close(sd);
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  long n_frames = argc > 1 ? atol(argv[1]) : 32;
+
+  if (not tap_uring::create(8)) {
+    printf("SKIP: io_uring not available\n");
+    return exit_skip;
+  }
+
+  std::string name;
+  int tap_fd = open_tap(name);
+  if (tap_fd < 0) {
+    return 1;
+  }
+
+  counting_switch sw;
+  bool ok = false;
+  {
+    tap_config cfg;
+    cfg.io_uring = true;
+    tap_io io(cfg);
+    io.register_tap(tap_fd, 1, sw);
+
+    // the reads are posted once the tap_io thread picked up the tap
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    if (send_frames(name, n_frames)) {
+      auto deadline = std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds(timeout_ms);
+      while (sw.n_frames < n_frames &&
+             std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      ok = sw.n_frames == n_frames;
+    }
+    io.unregister_tap(tap_fd, 1);
+  }
+
+  close(tap_fd);
+  printf("%s: %ld of %ld frames read through io_uring from %s\n",
+         ok ? "PASS" : "FAIL", sw.n_frames.load(), n_frames, name.c_str());
+  return ok ? 0 : 1;
+}
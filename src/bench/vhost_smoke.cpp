@@ -0,0 +1,210 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Smoke test of tap_vhost on a scratch tap: a frame written through the TX
+// virtqueue has to show up on the host side of the tap, and a frame sent by
+// the host has to be received through the RX virtqueue. Needs CAP_NET_ADMIN
+// and /dev/vhost-net, exits with 77 (skipped) without the latter.
+//
+// usage: vhost_smoke
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "roflibs/netlink/cpacketpool.hpp"
+#include "roflibs/netlink/tap_vhost.hpp"
+
+using namespace rofcore;
+
+namespace {
+
+const int exit_skip = 77;
+const int timeout_ms = 1000;
+
+int open_tap(std::string &name) {
+  int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open /dev/net/tun");
+    return -1;
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  strncpy(ifr.ifr_name, "bbsmoke%d", IFNAMSIZ - 1);
+  if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+    perror("TUNSETIFF");
+    close(fd);
+    return -1;
+  }
+  name = ifr.ifr_name;
+
+  int sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sd < 0 || ioctl(sd, SIOCGIFFLAGS, &ifr) < 0 ||
+      (ifr.ifr_flags |= IFF_UP, ioctl(sd, SIOCSIFFLAGS, &ifr) < 0)) {
+    perror("setting the tap up");
+    if (sd >= 0)
+      close(sd);
+    close(fd);
+    return -1;
+  }
+  close(sd);
+  return fd;
+}
+
+// packet socket on the host side of the tap
+int open_host_socket(const std::string &name) {
+  int sd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  htons(ETH_P_ALL));
+  if (sd < 0) {
+    perror("socket AF_PACKET");
+    return -1;
+  }
+
+  struct sockaddr_ll sll;
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = if_nametoindex(name.c_str());
+  if (bind(sd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    perror("bind");
+    close(sd);
+    return -1;
+  }
+  return sd;
+}
+
+std::vector<uint8_t> make_frame(uint8_t marker) {
+  // broadcast with a local experimental ethertype
+  std::vector<uint8_t> frame(ETH_ZLEN + 4, marker);
+  memset(frame.data(), 0xff, ETH_ALEN);
+  memset(frame.data() + ETH_ALEN, 0x02, ETH_ALEN);
+  frame[12] = 0x88;
+  frame[13] = 0xb5;
+  return frame;
+}
+
+bool wait_readable(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, timeout_ms) == 1;
+}
+
+// frames from the tap show up as received by the host
+bool test_tx(tap_vhost &vhost, int host_sd) {
+  std::vector<uint8_t> frame = make_frame(0x5a);
+  packet_ptr pkt = cpacketpool::get_instance().acquire_pkt(frame.size());
+  pkt->unpack(frame.data(), frame.size());
+
+  std::deque<packet_ptr> pkts;
+  pkts.push_back(std::move(pkt));
+  if (vhost.write(pkts) != 1) {
+    fprintf(stderr, "tx: no descriptor available\n");
+    return false;
+  }
+
+  size_t n_done = 0;
+  while (n_done == 0 && wait_readable(vhost.get_event_fd())) {
+    vhost.ack_event();
+    n_done += vhost.reap_tx();
+  }
+  if (n_done != 1) {
+    fprintf(stderr, "tx: buffer not used by vhost-net\n");
+    return false;
+  }
+
+  uint8_t buf[ETH_FRAME_LEN];
+  while (wait_readable(host_sd)) {
+    struct sockaddr_ll from;
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(host_sd, buf, sizeof(buf), 0,
+                           (struct sockaddr *)&from, &from_len);
+    if (len == (ssize_t)frame.size() && from.sll_pkttype != PACKET_OUTGOING &&
+        memcmp(buf, frame.data(), len) == 0) {
+      return true;
+    }
+  }
+  fprintf(stderr, "tx: frame not received by the host\n");
+  return false;
+}
+
+// frames sent by the host show up in the RX virtqueue
+bool test_rx(tap_vhost &vhost, int host_sd) {
+  while (vhost.rx_room()) {
+    vhost.post_rx(cpacketpool::get_instance().acquire_pkt(
+        cpacketpool::default_pkt_size + sizeof(struct virtio_net_hdr)));
+  }
+  vhost.kick_rx();
+
+  std::vector<uint8_t> frame = make_frame(0xa5);
+  if (send(host_sd, frame.data(), frame.size(), 0) < 0) {
+    perror("send");
+    return false;
+  }
+
+  std::deque<packet_ptr> pkts;
+  while (wait_readable(vhost.get_event_fd())) {
+    vhost.ack_event();
+    vhost.reap_rx(pkts);
+    for (auto &pkt : pkts) {
+      // the host may send e.g. router solicitations to a new interface, too
+      if (pkt->length() == frame.size() &&
+          memcmp(pkt->soframe(), frame.data(), frame.size()) == 0) {
+        return true;
+      }
+    }
+    pkts.clear();
+  }
+  fprintf(stderr, "rx: frame not received through vhost-net\n");
+  return false;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (access("/dev/vhost-net", R_OK | W_OK) < 0) {
+    printf("SKIP: /dev/vhost-net not available\n");
+    return exit_skip;
+  }
+
+  std::string name;
+  int tap_fd = open_tap(name);
+  if (tap_fd < 0) {
+    return 1;
+  }
+  int host_sd = open_host_socket(name);
+  if (host_sd < 0) {
+    close(tap_fd);
+    return 1;
+  }
+
+  bool ok = false;
+  {
+    std::unique_ptr<tap_vhost> vhost = tap_vhost::create(tap_fd);
+    if (not vhost) {
+      fprintf(stderr, "failed to attach vhost-net to %s\n", name.c_str());
+    } else {
+      ok = test_tx(*vhost, host_sd) && test_rx(*vhost, host_sd);
+    }
+  }
+
+  close(host_sd);
+  close(tap_fd);
+  printf("%s: tap_vhost on %s\n", ok ? "PASS" : "FAIL", name.c_str());
+  return ok ? 0 : 1;
+}
@@ -6,11 +6,13 @@
 #include <iterator>
 
 #include "cnetlink.hpp"
+#include "tap_manager.hpp"
 
 namespace rofcore {
 
 cnetlink::cnetlink(switch_interface *swi)
-    : swi(swi), thread(this), bridge(nullptr), running(false) {
+    : swi(swi), tap_man(nullptr), thread(this), bridge(nullptr),
+      running(false) {
 
   sock = nl_socket_alloc();
   if (NULL == sock) {
@@ -375,6 +377,12 @@ void cnetlink::route_link_apply(int action, const nl_obj &obj) {
 
   crtlink rtlink((struct rtnl_link *)obj.get_obj());
 
+  // size the tap read buffers according to the link mtu
+  if (action != NL_ACT_DEL && s1 != ifindex_to_registered_port.end() &&
+      tap_man != nullptr && rtlink.get_mtu()) {
+    tap_man->change_port_mtu(s1->second, rtlink.get_mtu());
+  }
+
   try {
     switch (action) {
     case NL_ACT_NEW: {
@@ -736,6 +744,10 @@ void cnetlink::register_switch(switch_interface *swi) noexcept {
   this->swi = swi;
 }
 
+void cnetlink::register_tap_manager(tap_manager *tm) noexcept {
+  this->tap_man = tm;
+}
+
 void cnetlink::unregister_switch(switch_interface *swi) noexcept {
   // TODO we should remove the swi here
   stop();
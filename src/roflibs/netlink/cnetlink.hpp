@@ -41,6 +41,8 @@ public:
   eNetLinkFailed(const std::string &__arg) : eNetLinkBase(__arg){};
 };
 
+class tap_manager;
+
 class cnetlink : public rofl::cthread_env {
   enum nl_cache_t {
     NL_LINK_CACHE,
@@ -53,6 +55,7 @@ class cnetlink : public rofl::cthread_env {
   };
 
   switch_interface *swi;
+  tap_manager *tap_man;
 
   rofl::cthread thread;
   struct nl_sock *sock;
@@ -134,6 +137,8 @@ public:
   void register_switch(switch_interface *) noexcept;
   void unregister_switch(switch_interface *) noexcept;
 
+  void register_tap_manager(tap_manager *) noexcept;
+
   void port_status_changed(uint32_t, enum nbi::port_status) noexcept;
 
   static void nl_cb(struct nl_cache *cache, struct nl_object *obj, int action,
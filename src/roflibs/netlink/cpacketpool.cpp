@@ -2,57 +2,499 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+
 #include <glog/logging.h>
 
 #include "cpacketpool.hpp"
 
 using namespace rofcore;
 
-cpacketpool::cpacketpool(unsigned int n_pkts, unsigned int pkt_size) {
-  for (unsigned int i = 0; i < n_pkts; ++i) {
-    rofl::cpacket *pkt = new rofl::cpacket(pkt_size);
-    pktpool.push_back(pkt);
-    idlepool.push_back(pkt);
-    VLOG(3) << __FUNCTION__ << ": created packet " << pkt;
+// set while the pool instance exists, caches of threads terminating after the
+// pool was destroyed must not hand back their packets
+static std::atomic<bool> pool_alive(false);
+
+struct cpacketpool::magazine {
+  std::vector<packet *> pkts[n_size_classes];
+
+  magazine() {
+    for (auto &p : pkts)
+      p.reserve(cache_size + 1);
   }
+  ~magazine() {
+    if (not pool_alive.load(std::memory_order_acquire))
+      return;
+    for (unsigned int i = 0; i < n_size_classes; ++i)
+      cpacketpool::get_instance().flush(*this, i, pkts[i].size());
+  }
+};
+
+thread_local cpacketpool::magazine cpacketpool::local_cache;
+
+const unsigned int cpacketpool::size_classes[cpacketpool::n_size_classes] = {
+    256, 2048, 9216, 65792};
+
+// share of the configured pool size per size class, jumbo and GSO frames are
+// rare, do not preallocate as many of them
+static const unsigned int initial_share[] = {1, 1, 8, 32};
+static const unsigned int max_share[] = {1, 1, 1, 16};
 
-  pktpool.shrink_to_fit();
-  idlepool.shrink_to_fit();
+unsigned int cpacketpool::cfg_n_pkts = 256;
+unsigned int cpacketpool::cfg_max_pkts = 4096;
+unsigned int cpacketpool::cfg_slab_size = 64;
+
+static inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// map a region for n_slabs slabs of slab_bytes each, prefer hugepages and fall
+// back to lazily allocated normal pages. Each slab is padded to the page size
+// of the region, so that idle slabs can be returned to the system. Hugetlb
+// pages are only used if a slab spans at least one of them, padding smaller
+// slabs would waste most of the region.
+static uint8_t *map_region(size_t slab_bytes, unsigned int n_slabs,
+                           size_t &slab_stride, size_t &size, bool &hugepages) {
+  static const size_t hugepage_size = 2 << 20;
+
+  if (slab_bytes >= hugepage_size) {
+    size_t stride = (slab_bytes + hugepage_size - 1) & ~(hugepage_size - 1);
+    void *mem = mmap(nullptr, stride * n_slabs, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+      slab_stride = stride;
+      size = stride * n_slabs;
+      hugepages = true;
+      return (uint8_t *)mem;
+    }
+    VLOG(1) << __FUNCTION__ << ": MAP_HUGETLB failed for "
+            << stride * n_slabs << " bytes: " << strerror(errno);
+  }
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t stride = (slab_bytes + page_size - 1) & ~(page_size - 1);
+  size_t len = stride * n_slabs;
+  void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    LOG(FATAL) << __FUNCTION__ << ": failed to map " << len
+               << " bytes: " << strerror(errno);
+  }
+  // use transparent hugepages if available
+  madvise(mem, len, MADV_HUGEPAGE);
+
+  slab_stride = stride;
+  size = len;
+  hugepages = false;
+  return (uint8_t *)mem;
+}
+
+cpacketpool::size_class::size_class(unsigned int index, unsigned int pkt_size,
+                                    unsigned int n_pkts, unsigned int max_pkts,
+                                    unsigned int slab_size)
+    : index(index), pkt_size(pkt_size),
+      stride((packet::default_headroom + pkt_size + cache_line - 1) &
+             ~(cache_line - 1)),
+      slab_size(std::max(slab_size, 1u)),
+      n_slabs_min((n_pkts + this->slab_size - 1) / this->slab_size),
+      n_slabs_max(
+          (std::max(n_pkts, max_pkts) + this->slab_size - 1) / this->slab_size),
+      mem(nullptr), mem_size(0), slab_bytes(0), hugepages(false),
+      pkts(new packet[n_slabs_max * this->slab_size]),
+      slab_used(n_slabs_max, false), n_slabs(0), n_pins(0),
+      idlepool(n_slabs_max * this->slab_size) {
+  mem = map_region((size_t)this->slab_size * stride, n_slabs_max, slab_bytes,
+                   mem_size, hugepages);
+
+  for (unsigned int i = 0; i < n_slabs_max * this->slab_size; ++i) {
+    packet &pkt = pkts[i];
+    pkt.data = mem + (size_t)(i / this->slab_size) * slab_bytes +
+               (size_t)(i % this->slab_size) * stride;
+    pkt.size = pkt_size;
+    pkt.clear();
+    pkt.size_class = index;
+  }
+
+  for (unsigned int i = 0; i < n_slabs_min; ++i) {
+    add_slab();
+  }
+}
+
+cpacketpool::size_class::~size_class() { munmap(mem, mem_size); }
+
+void cpacketpool::size_class::add_slab() {
+  assert(n_slabs < n_slabs_max);
+  unsigned int slab =
+      std::find(slab_used.begin(), slab_used.end(), false) - slab_used.begin();
+  for (unsigned int i = 0; i < slab_size; ++i) {
+    idlepool.push(&pkts[slab * slab_size + i]);
+  }
+  slab_used[slab] = true;
+  ++n_slabs;
+}
+
+void cpacketpool::size_class::remove_slab(unsigned int slab) {
+  assert(slab_used[slab]);
+  uint8_t *addr = mem + (size_t)slab * slab_bytes;
+  slab_used[slab] = false;
+  --n_slabs;
+  if (madvise(addr, slab_bytes, MADV_DONTNEED) == 0) {
+    return;
+  }
+
+  // hugetlb mappings support MADV_DONTNEED only since Linux 5.18. Replacing
+  // the slab frees its hugepages, it is backed by lazily allocated normal
+  // pages once added again.
+  if (hugepages && errno == EINVAL &&
+      mmap(addr, slab_bytes, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+           0) != MAP_FAILED) {
+    madvise(addr, slab_bytes, MADV_HUGEPAGE);
+    LOG_FIRST_N(INFO, 1) << __FUNCTION__
+                         << ": MADV_DONTNEED not supported on hugetlb, "
+                            "replacing released slabs with normal pages";
+    return;
+  }
+  LOG(WARNING) << __FUNCTION__ << ": failed to release slab " << slab
+               << " of size class " << index << ": " << strerror(errno);
+}
+
+cpacketpool::cpacketpool(unsigned int n_pkts, unsigned int max_pkts,
+                         unsigned int slab_size)
+    : has_waiters(false), n_acquired(0), n_released(0), n_exhausted(0),
+      n_in_use(0), n_high_water(0) {
+  for (auto &h : hold_hist) {
+    h.store(0, std::memory_order_relaxed);
+  }
+
+  for (unsigned int i = 0; i < n_size_classes; ++i) {
+    size_class *sc = new size_class(
+        i, size_classes[i], n_pkts / initial_share[i],
+        std::max(max_pkts / max_share[i], 1u), slab_size);
+    classes.emplace_back(sc);
+
+    LOG(INFO) << __FUNCTION__ << ": pkt_size=" << sc->pkt_size
+              << " stride=" << sc->stride
+              << " n_pkts=" << sc->n_slabs * sc->slab_size
+              << " max_pkts=" << sc->n_slabs_max * sc->slab_size
+              << " slab_size=" << sc->slab_size << " region=" << sc->mem_size
+              << (sc->hugepages ? " (hugepages)" : "");
+  }
+  pool_alive.store(true, std::memory_order_release);
 }
 
 cpacketpool::cpacketpool(cpacketpool const &packetpool) {}
 
 cpacketpool::~cpacketpool() {
-  for (std::vector<rofl::cpacket *>::iterator it = pktpool.begin();
-       it != pktpool.end(); ++it) {
-    delete (*it);
+  pool_alive.store(false, std::memory_order_release);
+  classes.clear();
+}
+
+void cpacketpool::configure(unsigned int n_pkts, unsigned int max_pkts,
+                            unsigned int slab_size) {
+  if (pool_alive.load(std::memory_order_acquire)) {
+    LOG(ERROR) << __FUNCTION__ << ": pool already created, ignoring config";
+    return;
   }
-  pktpool.clear();
+  cfg_n_pkts = n_pkts;
+  cfg_max_pkts = max_pkts;
+  cfg_slab_size = slab_size;
 }
 
 cpacketpool &cpacketpool::get_instance() {
-  static cpacketpool instance;
+  static cpacketpool instance(cfg_n_pkts, cfg_max_pkts, cfg_slab_size);
   return instance;
 }
 
-rofl::cpacket *cpacketpool::acquire_pkt() {
-  rofl::AcquireReadWriteLock rwlock(pool_rwlock);
-  if (idlepool.empty()) {
+unsigned int cpacketpool::class_of(size_t size) {
+  unsigned int i = 0;
+  while (i + 1 < n_size_classes && size_classes[i] < size) {
+    ++i;
+  }
+  return i;
+}
+
+void packet_deleter::operator()(packet *pkt) const {
+  cpacketpool::get_instance().release_pkt(pkt);
+}
+
+packet_ptr cpacketpool::acquire_pkt(size_t size) {
+  packet_ptr pkt = try_acquire_pkt(size);
+  if (pkt == nullptr) {
     throw ePacketPoolExhausted(
         "cpacketpool::acquire_pkt() packetpool exhausted");
   }
-  rofl::cpacket *pkt = idlepool.front();
-  idlepool.pop_front();
-  VLOG(3) << __FUNCTION__ << ": pkt=" << pkt;
   return pkt;
 }
 
-void cpacketpool::release_pkt(rofl::cpacket *pkt) {
+packet_ptr cpacketpool::try_acquire_pkt(size_t size) {
+  for (unsigned int i = class_of(size); i < n_size_classes; ++i) {
+    packet *pkt = acquire_from(i);
+    if (pkt) {
+      VLOG(3) << __FUNCTION__ << ": pkt=" << pkt << " size=" << size;
+
+      pkt->t_acquired = now_ns();
+      n_acquired.fetch_add(1, std::memory_order_relaxed);
+      int64_t in_use = n_in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+      int64_t hw = n_high_water.load(std::memory_order_relaxed);
+      while (in_use > hw && not n_high_water.compare_exchange_weak(
+                                hw, in_use, std::memory_order_relaxed))
+        ;
+      return packet_ptr(pkt);
+    }
+  }
+  n_exhausted.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+packet *cpacketpool::acquire_from(unsigned int i) {
+  std::vector<packet *> &pkts = local_cache.pkts[i];
+  if (pkts.empty()) {
+    refill(local_cache, i);
+    while (pkts.empty() && grow(*classes[i])) {
+      refill(local_cache, i);
+    }
+    if (pkts.empty()) {
+      return nullptr;
+    }
+  }
+  packet *pkt = pkts.back();
+  pkts.pop_back();
+  return pkt;
+}
+
+void cpacketpool::release_pkt(packet *pkt) {
   assert(pkt);
   pkt->clear();
   VLOG(3) << __FUNCTION__ << ": pkt=" << pkt;
+
+  uint64_t us = (now_ns() - pkt->t_acquired) / 1000;
+  unsigned int bucket = us ? 63 - __builtin_clzll(us) : 0;
+  hold_hist[std::min(bucket, n_hold_buckets - 1)].fetch_add(
+      1, std::memory_order_relaxed);
+  n_released.fetch_add(1, std::memory_order_relaxed);
+  n_in_use.fetch_sub(1, std::memory_order_relaxed);
+
+  std::vector<packet *> &pkts = local_cache.pkts[pkt->size_class];
+  pkts.push_back(pkt);
+  if (pkts.size() > cache_size) {
+    flush(local_cache, pkt->size_class, cache_batch);
+  } else if (has_waiters.load(std::memory_order_relaxed)) {
+    // packets in the cache are invisible to other threads
+    flush(local_cache, pkt->size_class, pkts.size());
+  }
+}
+
+void cpacketpool::refill(magazine &mag, unsigned int i) {
+  packet *pkt = nullptr;
+  for (unsigned int n = 0; n < cache_batch && classes[i]->idlepool.pop(pkt);
+       ++n) {
+    mag.pkts[i].push_back(pkt);
+  }
+}
+
+bool cpacketpool::grow(size_class &sc) {
+  std::lock_guard<std::mutex> lock(sc.slab_mutex);
+
+  // another thread might have grown the pool in the meantime
+  if (sc.idlepool.size() >= cache_batch) {
+    return true;
+  }
+
+  if (sc.n_slabs == sc.n_slabs_max) {
+    return false;
+  }
+
+  sc.add_slab();
+
+  LOG(INFO) << __FUNCTION__ << ": added slab, pkt_size=" << sc.pkt_size
+            << " pool size=" << sc.n_slabs * sc.slab_size;
+  return true;
+}
+
+void cpacketpool::shrink() {
+  for (auto &sc : classes) {
+    shrink(*sc);
+  }
+}
+
+void cpacketpool::shrink(size_class &sc) {
+  std::lock_guard<std::mutex> lock(sc.slab_mutex);
+
+  if (sc.n_pins > 0 || sc.n_slabs <= sc.n_slabs_min ||
+      sc.idlepool.size() < 2 * sc.slab_size) {
+    return;
+  }
+
+  // collect the idle packets, concurrent acquirers block in grow() until they
+  // are returned
+  std::vector<packet *> idle;
+  std::vector<unsigned int> n_idle(sc.n_slabs_max, 0);
+  packet *pkt = nullptr;
+  idle.reserve(sc.idlepool.size());
+  while (sc.idlepool.pop(pkt)) {
+    idle.push_back(pkt);
+    ++n_idle[(pkt - sc.pkts.get()) / sc.slab_size];
+  }
+
+  // release completely idle slabs, keep one slab of idle packets as headroom
+  size_t n_keep = idle.size();
+  std::vector<bool> release(sc.n_slabs_max, false);
+  for (unsigned int slab = sc.n_slabs_max; slab-- > 0;) {
+    if (sc.n_slabs <= sc.n_slabs_min || n_keep < 2 * sc.slab_size) {
+      break;
+    }
+    if (n_idle[slab] == sc.slab_size) {
+      release[slab] = true;
+      sc.remove_slab(slab);
+      n_keep -= sc.slab_size;
+
+      LOG(INFO) << __FUNCTION__ << ": released slab " << slab
+                << ", pkt_size=" << sc.pkt_size
+                << " pool size=" << sc.n_slabs * sc.slab_size;
+    }
+  }
+
+  for (auto p : idle) {
+    if (not release[(p - sc.pkts.get()) / sc.slab_size]) {
+      sc.idlepool.push(p);
+    }
+  }
+}
+
+unsigned int cpacketpool::size() {
+  unsigned int n = 0;
+  for (auto &sc : classes) {
+    std::lock_guard<std::mutex> lock(sc->slab_mutex);
+    n += sc->n_slabs * sc->slab_size;
+  }
+  return n;
+}
+
+std::vector<struct iovec> cpacketpool::get_regions() {
+  std::vector<struct iovec> regions;
+  for (auto &sc : classes) {
+    regions.push_back(iovec{sc->mem, sc->mem_size});
+  }
+  return regions;
+}
+
+void cpacketpool::pin_regions() {
+  for (auto &sc : classes) {
+    std::lock_guard<std::mutex> lock(sc->slab_mutex);
+    ++sc->n_pins;
+  }
+}
+
+void cpacketpool::unpin_regions() {
+  for (auto &sc : classes) {
+    std::lock_guard<std::mutex> lock(sc->slab_mutex);
+    assert(sc->n_pins > 0);
+    --sc->n_pins;
+  }
+}
+
+cpacketpool::stats cpacketpool::get_stats() {
+  stats s;
+  s.acquired = n_acquired.load(std::memory_order_relaxed);
+  s.released = n_released.load(std::memory_order_relaxed);
+  s.exhausted = n_exhausted.load(std::memory_order_relaxed);
+  s.in_use = n_in_use.load(std::memory_order_relaxed);
+  s.high_water = n_high_water.load(std::memory_order_relaxed);
+  s.size = size();
+  for (unsigned int i = 0; i < n_hold_buckets; ++i) {
+    s.hold_time[i] = hold_hist[i].load(std::memory_order_relaxed);
+  }
+  return s;
+}
+
+std::ostream &rofcore::operator<<(std::ostream &os,
+                                  const cpacketpool::stats &s) {
+  os << "size=" << s.size << " in_use=" << s.in_use
+     << " high_water=" << s.high_water << " acquired=" << s.acquired
+     << " released=" << s.released << " exhausted=" << s.exhausted
+     << " hold_time_us={";
+  bool first = true;
+  for (unsigned int i = 0; i < cpacketpool::n_hold_buckets; ++i) {
+    if (s.hold_time[i] == 0)
+      continue;
+    os << (first ? "" : " ") << (i ? 1ull << i : 0) << ":" << s.hold_time[i];
+    first = false;
+  }
+  return os << "}";
+}
+
+void cpacketpool::flush(magazine &mag, unsigned int i, unsigned int n_pkts) {
+  std::vector<packet *> &pkts = mag.pkts[i];
+
+  // move the least recently released packets, the hot ones stay local
+  n_pkts = std::min<size_t>(n_pkts, pkts.size());
+  for (unsigned int n = 0; n < n_pkts; ++n) {
+    // the ring holds every packet of the class, hence this cannot fail unless
+    // a packet is released twice
+    if (not classes[i]->idlepool.push(pkts[n])) {
+      LOG(FATAL) << __FUNCTION__ << ": idlepool overflow, pkt=" << pkts[n];
+    }
+  }
+  pkts.erase(pkts.begin(), pkts.begin() + n_pkts);
+
+  // pairs with the fence in wait_for_pkts(), either the waiter sees the
+  // packets in idlepool or we see the waiter
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (n_pkts && has_waiters.load(std::memory_order_relaxed)) {
+    notify_waiters(i);
+  }
+}
+
+void cpacketpool::wait_for_pkts(packet_waiter *waiter, size_t size) {
+  unsigned int i = class_of(size);
   {
-    rofl::AcquireReadWriteLock rwlock(pool_rwlock);
-    idlepool.push_back(pkt);
+    std::lock_guard<std::mutex> lock(waiters_mutex);
+    waiters.emplace_back(waiter, i);
+    has_waiters.store(true, std::memory_order_relaxed);
+  }
+  VLOG(1) << __FUNCTION__ << ": waiter=" << waiter << " size=" << size;
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (; i < n_size_classes; ++i) {
+    if (classes[i]->idlepool.size()) {
+      notify_waiters(i);
+      return;
+    }
+  }
+}
+
+void cpacketpool::cancel_wait(packet_waiter *waiter) {
+  std::lock_guard<std::mutex> lock(waiters_mutex);
+  waiters.erase(std::remove_if(waiters.begin(), waiters.end(),
+                               [waiter](std::pair<packet_waiter *,
+                                                  unsigned int> &w) {
+                                 return w.first == waiter;
+                               }),
+                waiters.end());
+  has_waiters.store(not waiters.empty(), std::memory_order_relaxed);
+}
+
+void cpacketpool::notify_waiters(unsigned int i) {
+  // notify while holding the lock, so cancel_wait() guarantees that a waiter
+  // is not called anymore once it returns
+  std::lock_guard<std::mutex> lock(waiters_mutex);
+  for (auto it = waiters.begin(); it != waiters.end();) {
+    if (it->second <= i) {
+      VLOG(1) << __FUNCTION__ << ": waiter=" << it->first;
+      it->first->pkts_available();
+      it = waiters.erase(it);
+    } else {
+      ++it;
+    }
   }
+  has_waiters.store(not waiters.empty(), std::memory_order_relaxed);
 }
@@ -5,12 +5,17 @@
 #ifndef CPACKETPOOL_H_
 #define CPACKETPOOL_H_ 1
 
+#include <sys/uio.h>
+
+#include <atomic>
 #include <exception>
+#include <memory>
+#include <mutex>
+#include <ostream>
 #include <vector>
-#include <deque>
 
-#include <rofl/common/cpacket.h>
-#include <rofl/common/locking.hpp>
+#include "roflibs/netlink/mpmc_ring.hpp"
+#include "roflibs/netlink/packet.hpp"
 
 namespace rofcore {
 
@@ -23,26 +28,230 @@ public:
   ePacketPoolExhausted(const std::string &__arg) : ePacketPoolBase(__arg){};
 };
 
+/**
+ * @brief interface of threads waiting for an exhausted pool to refill
+ *
+ * pkts_available() is called once per cpacketpool::wait_for_pkts() on the
+ * thread releasing packets, implementations must not block or call back into
+ * the pool and should only wake up their own thread.
+ */
+class packet_waiter {
+public:
+  virtual ~packet_waiter() {}
+  virtual void pkts_available() = 0;
+};
+
 class cpacketpool {
   static cpacketpool *packetpool;
-  cpacketpool(unsigned int n_pkts = 256, unsigned int pkt_size = 1518);
+  cpacketpool(unsigned int n_pkts, unsigned int max_pkts,
+              unsigned int slab_size);
   cpacketpool(cpacketpool const &packetpool);
   ~cpacketpool();
 
-  std::vector<rofl::cpacket *> pktpool;
-  std::deque<rofl::cpacket *> idlepool;
+  // pool sizing, see configure()
+  static unsigned int cfg_n_pkts;
+  static unsigned int cfg_max_pkts;
+  static unsigned int cfg_slab_size;
+
+  /**
+   * all packets of one buffer size
+   *
+   * The frame buffers of a class live in a single memory region reserved for
+   * the maximum pool size. Slabs are consecutive ranges of slab_size buffers
+   * put into service when growing, each padded to slab_bytes, a multiple of
+   * the page size of the region. Buffer i including its headroom starts at
+   * mem + (i / slab_size) * slab_bytes + (i % slab_size) * stride.
+   */
+  struct size_class {
+    size_class(unsigned int index, unsigned int pkt_size, unsigned int n_pkts,
+               unsigned int max_pkts, unsigned int slab_size);
+    ~size_class();
+
+    const unsigned int index;
+    const unsigned int pkt_size;
+    const unsigned int stride;
+    const unsigned int slab_size;
+    const unsigned int n_slabs_min;
+    const unsigned int n_slabs_max;
+
+    uint8_t *mem;
+    size_t mem_size;
+    size_t slab_bytes;
+    bool hugepages;
+
+    // descriptors of all buffers in mem
+    std::unique_ptr<packet[]> pkts;
+
+    // slabs in service, guarded by slab_mutex
+    std::vector<bool> slab_used;
+    unsigned int n_slabs;
+    // number of pin_regions() calls not yet undone, no slab is released while
+    // the region is pinned
+    unsigned int n_pins;
+    std::mutex slab_mutex;
+
+    // idle packets, shared lock-free between all producer/consumer threads
+    mpmc_ring<packet *> idlepool;
+
+    void add_slab();
+    void remove_slab(unsigned int slab);
+  };
+
+  std::vector<std::unique_ptr<size_class>> classes;
+
+  // per-thread cache of idle packets in front of idlepool
+  struct magazine;
+  static thread_local magazine local_cache;
+
+  // alignment of frame buffers
+  static const unsigned int cache_line = 64;
+
+  // max number of packets held by a thread's cache per size class
+  static const unsigned int cache_size = 32;
+  // number of packets moved between a cache and idlepool at once
+  static const unsigned int cache_batch = 16;
+
+  // threads waiting for packets, with the smallest size class they accept
+  std::vector<std::pair<packet_waiter *, unsigned int>> waiters;
+  std::mutex waiters_mutex;
+  std::atomic<bool> has_waiters;
+
+  static unsigned int class_of(size_t size);
+  packet *acquire_from(unsigned int size_class);
+  void refill(magazine &mag, unsigned int size_class);
+  void flush(magazine &mag, unsigned int size_class, unsigned int n_pkts);
+  bool grow(size_class &sc);
+  void shrink(size_class &sc);
+  void notify_waiters(unsigned int size_class);
 
-  // lock for peer controllers
-  rofl::crwlock pool_rwlock;
+public:
+  // hold time histogram bucket i counts packets released after
+  // [2^i, 2^(i+1)) us, the first and last bucket are open ended
+  static const unsigned int n_hold_buckets = 24;
+
+  struct stats {
+    uint64_t acquired;  // packets handed out
+    uint64_t released;  // packets returned
+    uint64_t exhausted; // failed acquires
+    int64_t in_use;     // packets currently held
+    int64_t high_water; // max of in_use since start
+    unsigned int size;  // packets currently in service
+    uint64_t hold_time[n_hold_buckets];
+  };
+
+private:
+  // counters are updated with relaxed ordering, stats are approximate while
+  // packets are in flight
+  std::atomic<uint64_t> n_acquired;
+  std::atomic<uint64_t> n_released;
+  std::atomic<uint64_t> n_exhausted;
+  std::atomic<int64_t> n_in_use;
+  std::atomic<int64_t> n_high_water;
+  std::atomic<uint64_t> hold_hist[n_hold_buckets];
 
 public:
+  // buffer sizes of the size classes in ascending order, the largest one
+  // fits a GSO frame read from a tap with IFF_VNET_HDR
+  static const unsigned int n_size_classes = 4;
+  static const unsigned int size_classes[n_size_classes];
+
+  // default buffer size, fits an untagged or tagged 1500 byte MTU frame
+  static const unsigned int default_pkt_size = 1522;
+
+  /**
+   * @brief set the pool size, must be called before get_instance()
+   *
+   * Applies to every size class, the jumbo class starts with an eighth of
+   * n_pkts.
+   *
+   * @param n_pkts number of packets allocated initially, the pool never
+   * shrinks below this low watermark
+   * @param max_pkts ceiling the pool may grow to
+   * @param slab_size number of packets allocated at once when growing
+   */
+  static void configure(unsigned int n_pkts, unsigned int max_pkts,
+                        unsigned int slab_size);
+
   static cpacketpool &get_instance();
 
-  rofl::cpacket *acquire_pkt();
+  /**
+   * @brief return idle slabs above the low watermark to the system
+   *
+   * Called periodically, keeps one slab of idle packets as headroom. A slab
+   * is only released if all of its packets are idle in the shared pool.
+   */
+  void shrink();
+
+  unsigned int size();
+
+  /**
+   * @brief snapshot of the pool counters
+   */
+  stats get_stats();
+
+  /**
+   * @brief memory regions backing the packet buffers, indexed by region_of()
+   *
+   * Each region is reserved for the maximum pool size, e.g. for registering
+   * the buffers with the kernel.
+   */
+  std::vector<struct iovec> get_regions();
 
-  void release_pkt(rofl::cpacket *pkt);
+  static unsigned int region_of(const packet *pkt) { return pkt->size_class; }
+
+  /**
+   * @brief stop returning idle slabs to the system
+   *
+   * Must be called before the regions are registered with the kernel, which
+   * pins their pages. A slab released by shrink() would get fresh zeroed pages
+   * while the kernel keeps using the pinned ones. Calls are counted, each one
+   * is undone by unpin_regions().
+   */
+  void pin_regions();
+
+  void unpin_regions();
+
+  /**
+   * @brief acquire a packet with a buffer of at least size bytes
+   *
+   * Uses the smallest size class that fits, falls back to larger classes in
+   * case that one is exhausted. Sizes beyond the largest class get a buffer
+   * of the largest class.
+   *
+   * @throws ePacketPoolExhausted in case no packet is available
+   */
+  packet_ptr acquire_pkt(size_t size = default_pkt_size);
+
+  /**
+   * @brief acquire a packet like acquire_pkt() without throwing
+   *
+   * @return nullptr in case no packet is available
+   */
+  packet_ptr try_acquire_pkt(size_t size = default_pkt_size);
+
+  /**
+   * @brief get notified once a packet of at least size bytes was released
+   *
+   * To be called after try_acquire_pkt() failed. The notification is one-shot
+   * and may be spurious, i.e. the next try_acquire_pkt() can still fail. In
+   * case packets became available in the meantime the waiter is notified
+   * right away.
+   */
+  void wait_for_pkts(packet_waiter *waiter, size_t size = default_pkt_size);
+
+  /**
+   * @brief remove a waiter registered with wait_for_pkts()
+   */
+  void cancel_wait(packet_waiter *waiter);
+
+  /**
+   * @brief return a packet to the pool, prefer letting a packet_ptr go
+   */
+  void release_pkt(packet *pkt);
 };
 
+std::ostream &operator<<(std::ostream &os, const cpacketpool::stats &s);
+
 }; // end of namespace vmcore
 
 #endif /* CPACKETPOOL_H_ */
@@ -7,6 +7,7 @@
 #include <linux/if.h>
 #include <linux/if_tun.h>
 
+#include <algorithm>
 #include <cerrno>
 
 #include <glog/logging.h>
@@ -17,7 +18,10 @@
 
 namespace rofcore {
 
-ctapdev::ctapdev(std::string const &devname) : fd(-1), devname(devname) {
+ctapdev::ctapdev(std::string const &devname, unsigned int n_queues,
+                 bool vnet_hdr, unsigned int offload)
+    : devname(devname), n_queues(std::max(n_queues, 1u)),
+      vnet_hdr(vnet_hdr), offload(offload) {
   if (devname.size() > IFNAMSIZ) {
     throw std::length_error("devname.size() > IFNAMSIZ");
   }
@@ -29,41 +33,74 @@ void ctapdev::tap_open() {
   struct ifreq ifr;
   int rc;
 
-  if (fd != -1) {
-    VLOG(1) << __FUNCTION__ << ": tapdev is already open using fd=" << fd;
+  if (not fds.empty()) {
+    VLOG(1) << __FUNCTION__
+            << ": tapdev is already open using fd=" << get_fd();
     return;
   }
 
-  if ((fd = open("/dev/net/tun", O_RDWR)) < 0) {
-    LOG(FATAL) << __FUNCTION__
-               << ": could not open /dev/net/tun (module loaded?)";
-  }
-
   memset(&ifr, 0, sizeof(ifr));
   ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  if (n_queues > 1) {
+    // every TUNSETIFF on the same device attaches another queue
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+  if (vnet_hdr) {
+    // every frame is preceded by a struct virtio_net_hdr
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  }
   strncpy(ifr.ifr_name, devname.c_str(), IFNAMSIZ);
 
-  if ((rc = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
-    LOG(FATAL) << __FUNCTION__ << ": ioctl TUNSETIFF failed on fd=" << fd
-               << " errno=" << errno << " reason: " << strerror(errno);
-    close(fd);
-    fd = -1;
+  for (unsigned int i = 0; i < n_queues; i++) {
+    int fd;
+
+    // tap_io drains the tap until EAGAIN
+    if ((fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0) {
+      LOG(FATAL) << __FUNCTION__
+                 << ": could not open /dev/net/tun (module loaded?)";
+    }
+
+    if ((rc = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
+      LOG(FATAL) << __FUNCTION__ << ": ioctl TUNSETIFF failed on fd=" << fd
+                 << " errno=" << errno << " reason: " << strerror(errno);
+      close(fd);
+      continue;
+    }
+    fds.push_back(fd);
   }
 
-  LOG(INFO) << __FUNCTION__ << ": created tapdev " << devname << " fd=" << fd
+  if (vnet_hdr && not fds.empty()) {
+    int hdr_sz = sizeof(struct virtio_net_hdr);
+    if (ioctl(fds[0], TUNSETVNETHDRSZ, &hdr_sz) < 0) {
+      LOG(FATAL) << __FUNCTION__ << ": ioctl TUNSETVNETHDRSZ failed on fd="
+                 << fds[0] << " reason: " << strerror(errno);
+    }
+
+    // the offloads are a property of the device, not of a queue
+    if (ioctl(fds[0], TUNSETOFFLOAD, offload) < 0) {
+      LOG(ERROR) << __FUNCTION__ << ": ioctl TUNSETOFFLOAD failed on fd="
+                 << fds[0] << " reason: " << strerror(errno);
+    }
+  }
+
+  LOG(INFO) << __FUNCTION__ << ": created tapdev " << devname
+            << " fd=" << get_fd() << " n_queues=" << fds.size()
+            << " vnet_hdr=" << vnet_hdr << " offload=0x" << std::hex
+            << offload << std::dec
             << " tid=" << pthread_self();
 }
 
 void ctapdev::tap_close() {
-  if (fd == -1) {
+  if (fds.empty()) {
     return;
   }
 
-  int rv = close(fd);
-  if (rv < 0)
-    LOG(ERROR) << __FUNCTION__ << ": failed to close fd=" << fd;
-
-  fd = -1;
+  for (int fd : fds) {
+    int rv = close(fd);
+    if (rv < 0)
+      LOG(ERROR) << __FUNCTION__ << ": failed to close fd=" << fd;
+  }
+  fds.clear();
 
   LOG(INFO) << __FUNCTION__ << ": closed tapdev " << devname
             << " tid=" << pthread_self();
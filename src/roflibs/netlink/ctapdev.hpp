@@ -6,6 +6,7 @@
 
 #include <deque>
 #include <exception>
+#include <vector>
 
 #include <rofl/common/cthread.hpp>
 #include <rofl/common/cpacket.h>
@@ -13,15 +14,23 @@
 namespace rofcore {
 
 class ctapdev {
-  int fd; // tap device file descriptor
+  std::vector<int> fds; // tap device file descriptor per queue
   std::string devname;
+  unsigned int n_queues;
+  bool vnet_hdr;
+  unsigned int offload; // TUN_F_* flags, requires vnet_hdr
 
 public:
   /**
    *
    * @param devname
+   * @param n_queues number of queues, more than one creates the device with
+   * IFF_MULTI_QUEUE
+   * @param vnet_hdr create the device with IFF_VNET_HDR
+   * @param offload TUN_F_* offloads the host may hand over to us
    */
-  ctapdev(std::string const &devname);
+  ctapdev(std::string const &devname, unsigned int n_queues = 1,
+          bool vnet_hdr = false, unsigned int offload = 0);
 
   /**
    *
@@ -41,7 +50,12 @@ public:
    */
   void tap_close();
 
-  int get_fd() const { return fd; }
+  /**
+   * @brief fd of the first queue
+   */
+  int get_fd() const { return fds.empty() ? -1 : fds[0]; }
+
+  const std::vector<int> &get_fds() const { return fds; }
 };
 
 } // end of namespace rofcore
@@ -0,0 +1,180 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include <glog/logging.h>
+
+#include "roflibs/netlink/gso.hpp"
+
+namespace rofcore {
+
+namespace {
+
+const uint8_t tcp_fin = 0x01;
+const uint8_t tcp_psh = 0x08;
+const uint8_t tcp_cwr = 0x80;
+
+inline uint16_t get16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+inline uint32_t get32(const uint8_t *p) {
+  return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+inline void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+inline void put32(uint8_t *p, uint32_t v) {
+  put16(p, v >> 16);
+  put16(p + 2, v);
+}
+
+// ones' complement sum in network byte order, does not overflow for frames
+// up to 128 KiB
+uint32_t csum_add(uint32_t sum, const uint8_t *data, size_t len) {
+  while (len > 1) {
+    sum += get16(data);
+    data += 2;
+    len -= 2;
+  }
+  if (len)
+    sum += data[0] << 8;
+  return sum;
+}
+
+uint16_t csum_fold(uint32_t sum) {
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+} // namespace
+
+bool gso_needed(const packet &pkt) {
+  return (pkt.vnet_hdr().gso_type & ~virtio_net_hdr::GSO_ECN) !=
+         virtio_net_hdr::GSO_NONE;
+}
+
+bool csum_complete(packet &pkt) {
+  struct virtio_net_hdr &vh = pkt.vnet_hdr();
+  if (not(vh.flags & virtio_net_hdr::F_NEEDS_CSUM))
+    return true;
+
+  size_t start = vh.csum_start;
+  size_t field = start + vh.csum_offset;
+  if (field + 2 > pkt.length()) {
+    VLOG(1) << __FUNCTION__ << ": invalid csum_start=" << start
+            << " csum_offset=" << vh.csum_offset << " len=" << pkt.length();
+    return false;
+  }
+
+  // the field holds the pseudo header sum already
+  uint8_t *frame = pkt.soframe();
+  uint16_t csum = csum_fold(csum_add(0, frame + start, pkt.length() - start));
+  // a zero UDP checksum means none, as done by skb_checksum_help()
+  put16(frame + field, csum ? csum : 0xffff);
+  vh.flags &= ~virtio_net_hdr::F_NEEDS_CSUM;
+  return true;
+}
+
+int gso_segment(const packet &pkt, std::vector<uint8_t> &buf,
+                const std::function<void(uint8_t *, size_t)> &out) {
+  const struct virtio_net_hdr &vh = pkt.vnet_hdr();
+  const uint8_t *frame = pkt.soframe();
+  size_t len = pkt.length();
+  uint8_t type = vh.gso_type & ~virtio_net_hdr::GSO_ECN;
+
+  if ((type != virtio_net_hdr::GSO_TCPV4 &&
+       type != virtio_net_hdr::GSO_TCPV6) ||
+      vh.gso_size == 0) {
+    VLOG(1) << __FUNCTION__ << ": unsupported gso_type=" << (int)vh.gso_type
+            << " gso_size=" << vh.gso_size;
+    return -EINVAL;
+  }
+
+  // skip 802.1q/802.1ad tags
+  size_t l3 = ETH_HLEN;
+  if (len < l3)
+    return -EINVAL;
+  uint16_t proto = get16(frame + l3 - 2);
+  while (proto == ETH_P_8021Q || proto == ETH_P_8021AD) {
+    l3 += 4;
+    if (len < l3)
+      return -EINVAL;
+    proto = get16(frame + l3 - 2);
+  }
+
+  bool v4 = (type == virtio_net_hdr::GSO_TCPV4);
+  if (proto != (v4 ? ETH_P_IP : ETH_P_IPV6) || len < l3 + (v4 ? 20 : 40))
+    return -EINVAL;
+
+  // csum_start points to the TCP header and covers IPv6 extension headers
+  size_t l3_hlen = v4 ? (frame[l3] & 0x0f) * 4 : 40;
+  size_t l4 = (vh.flags & virtio_net_hdr::F_NEEDS_CSUM) ? vh.csum_start
+                                                         : l3 + l3_hlen;
+  if (l4 < l3 + l3_hlen || len < l4 + 20)
+    return -EINVAL;
+
+  size_t tcp_hlen = (frame[l4 + 12] >> 4) * 4;
+  size_t hdr_len = l4 + tcp_hlen;
+  if (tcp_hlen < 20 || len < hdr_len)
+    return -EINVAL;
+
+  size_t mss = vh.gso_size;
+  size_t payload = len - hdr_len;
+  uint32_t seq = get32(frame + l4 + 4);
+  uint16_t ip_id = v4 ? get16(frame + l3 + 4) : 0;
+  int n = 0;
+
+  buf.resize(hdr_len + std::min(mss, payload));
+  size_t off = 0;
+  do {
+    size_t seg = std::min(mss, payload - off);
+    bool last = (off + seg == payload);
+    uint8_t *ip = buf.data() + l3;
+    uint8_t *tcp = buf.data() + l4;
+    uint32_t sum;
+
+    memcpy(buf.data(), frame, hdr_len);
+    memcpy(buf.data() + hdr_len, frame + hdr_len + off, seg);
+
+    size_t tcp_len = tcp_hlen + seg;
+    if (v4) {
+      put16(ip + 2, l4 - l3 + tcp_len);
+      put16(ip + 4, ip_id + n);
+      put16(ip + 10, 0);
+      put16(ip + 10, csum_fold(csum_add(0, ip, l3_hlen)));
+
+      sum = csum_add(0, ip + 12, 8);
+    } else {
+      // the payload length includes extension headers
+      put16(ip + 4, l4 - l3 - 40 + tcp_len);
+
+      sum = csum_add(0, ip + 8, 32);
+    }
+    sum += IPPROTO_TCP + (tcp_len >> 16) + (tcp_len & 0xffff);
+
+    put32(tcp + 4, seq + off);
+    if (not last)
+      tcp[13] &= ~(tcp_fin | tcp_psh);
+    if (n > 0)
+      tcp[13] &= ~tcp_cwr;
+    put16(tcp + 16, 0);
+    put16(tcp + 16, csum_fold(csum_add(sum, tcp, tcp_len)));
+
+    out(buf.data(), hdr_len + seg);
+    off += seg;
+    n++;
+  } while (off < payload);
+
+  return n;
+}
+
+} // namespace rofcore
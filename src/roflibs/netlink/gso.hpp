@@ -0,0 +1,39 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "roflibs/netlink/packet.hpp"
+
+namespace rofcore {
+
+/**
+ * @brief true if pkt has to be segmented by gso_segment()
+ */
+bool gso_needed(const packet &pkt);
+
+/**
+ * @brief finish the partial checksum of pkt as requested by its vnet header
+ *
+ * @return false in case the vnet header does not fit the frame
+ */
+bool csum_complete(packet &pkt);
+
+/**
+ * @brief split a TCPv4/TCPv6 GSO frame into frames of gso_size payload
+ *
+ * Headers are copied for every segment, IP lengths, IPv4 ids, TCP sequence
+ * numbers and flags as well as all checksums are rewritten. The segments are
+ * built in buf one by one and passed to out.
+ *
+ * @return number of segments or -EINVAL in case the frame cannot be segmented
+ */
+int gso_segment(const packet &pkt, std::vector<uint8_t> &buf,
+                const std::function<void(uint8_t *, size_t)> &out);
+
+} // namespace rofcore
@@ -0,0 +1,127 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace rofcore {
+
+/**
+ * @brief bounded lock-free multi-producer/multi-consumer ring
+ *
+ * Every slot carries a sequence number telling producers and consumers
+ * whether the slot is free for writing or holds data for the current lap.
+ * Producers and consumers only contend on their respective cursor.
+ */
+template <typename T> class mpmc_ring {
+public:
+  /**
+   * @param capacity minimum number of slots, rounded up to a power of two
+   */
+  explicit mpmc_ring(size_t capacity)
+      : mask(round_up(capacity) - 1), cells(new cell[mask + 1]), head(0),
+        tail(0) {
+    for (size_t i = 0; i <= mask; ++i) {
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+  /**
+   * @brief append val to the ring
+   *
+   * @return false in case the ring is full
+   */
+  bool push(const T &val) {
+    cell *c;
+    size_t pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      c = &cells[pos & mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    c->data = val;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief remove the oldest element from the ring
+   *
+   * @return false in case the ring is empty
+   */
+  bool pop(T &val) {
+    cell *c;
+    size_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      c = &cells[pos & mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+    val = c->data;
+    c->seq.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief approximate number of elements, only exact when quiescent
+   */
+  size_t size() const {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_relaxed);
+    return t > h ? t - h : 0;
+  }
+
+private:
+  mpmc_ring(const mpmc_ring &) = delete;
+  mpmc_ring &operator=(const mpmc_ring &) = delete;
+
+  static size_t round_up(size_t v) {
+    size_t r = 1;
+    while (r < v)
+      r <<= 1;
+    return r;
+  }
+
+  struct cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  const size_t mask;
+  std::unique_ptr<cell[]> cells;
+
+  // keep the cursors on separate cache lines, padding is used instead of
+  // alignas() as rings are heap allocated
+  char pad0[64];
+  std::atomic<size_t> head;
+  char pad1[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail;
+  char pad2[64 - sizeof(std::atomic<size_t>)];
+};
+
+} // namespace rofcore
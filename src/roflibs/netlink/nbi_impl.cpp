@@ -9,13 +9,16 @@
 
 namespace rofcore {
 
-nbi_impl::nbi_impl() : tap_man(new tap_manager()) {
+nbi_impl::nbi_impl(const tap_config &cfg) : tap_man(new tap_manager(cfg)) {
   // start netlink
   cnetlink *nl = &cnetlink::get_instance();
-  (void)nl;
+  nl->register_tap_manager(tap_man.get());
 }
 
-nbi_impl::~nbi_impl() { cnetlink::get_instance().stop(); }
+nbi_impl::~nbi_impl() {
+  cnetlink::get_instance().register_tap_manager(nullptr);
+  cnetlink::get_instance().stop();
+}
 
 void nbi_impl::resend_state() noexcept {
   cnetlink::get_instance().resend_state();
@@ -47,27 +50,55 @@ void nbi_impl::port_notification(
 
 void nbi_impl::port_status_changed(uint32_t port_no,
                                    enum nbi::port_status ps) noexcept {
+  tap_man->change_port_status(
+      port_no, not(ps & (PORT_STATUS_LOWER_DOWN | PORT_STATUS_ADMIN_DOWN)));
   cnetlink::get_instance().port_status_changed(port_no, ps);
 }
 
-int nbi_impl::enqueue_to_switch(uint32_t port_id, rofl::cpacket *packet) {
-  swi->enqueue(port_id, packet);
-  return 0;
+int nbi_impl::enqueue_to_switch(uint32_t port_id, packet_ptr pkt) {
+  return swi->enqueue(port_id, std::move(pkt));
+}
+
+int nbi_impl::flood_to_switch(const std::vector<uint32_t> &port_ids,
+                              packet_ptr pkt) {
+  return swi->flood(port_ids, std::move(pkt));
 }
 
-int nbi_impl::enqueue(uint32_t port_id, rofl::cpacket *pkt) noexcept {
+int nbi_impl::enqueue(uint32_t port_id, packet_ptr pkt) noexcept {
   int rv = 0;
   assert(pkt);
   try {
-    tap_man->enqueue(port_id, pkt);
+    tap_man->enqueue(port_id, std::move(pkt));
   } catch (std::exception &e) {
     LOG(ERROR) << __FUNCTION__
                << ": failed to enqueue packet for port_id=" << port_id << ": "
                << e.what();
-    rofcore::cpacketpool::get_instance().release_pkt(pkt);
     rv = -1;
   }
   return rv;
 }
 
+int nbi_impl::enqueue(uint32_t port_id, const uint8_t *frame,
+                      size_t len) noexcept {
+  int rv = 0;
+  assert(frame);
+  try {
+    rv = tap_man->enqueue(port_id, frame, len);
+  } catch (std::exception &e) {
+    LOG(ERROR) << __FUNCTION__
+               << ": failed to enqueue frame for port_id=" << port_id << ": "
+               << e.what();
+    rv = -1;
+  }
+  return rv;
+}
+
+void nbi_impl::get_tx_stats(std::map<uint32_t, tap_io::tx_stats> &stats) {
+  tap_man->get_tx_stats(stats);
+}
+
+void nbi_impl::get_rx_stats(tap_io::rx_stats &stats) {
+  tap_man->get_rx_stats(stats);
+}
+
 } // namespace rofcore
@@ -1,14 +1,11 @@
 #pragma once
 
+#include <map>
 #include <memory>
 
 #include "sai.hpp"
 #include "tap_manager.hpp"
 
-namespace rofl {
-class cpacket;
-} // namespace rofl
-
 namespace rofcore {
 
 class tap_manager;
@@ -18,7 +15,7 @@ class nbi_impl : public nbi, public switch_callback {
   switch_interface *swi;
 
 public:
-  nbi_impl();
+  nbi_impl(const tap_config &cfg = tap_config());
   virtual ~nbi_impl();
 
   // nbi
@@ -27,10 +24,24 @@ public:
   void
   port_notification(std::deque<port_notification_data> &) noexcept override;
   void port_status_changed(uint32_t port, enum port_status) noexcept override;
-  int enqueue(uint32_t port_id, rofl::cpacket *pkt) noexcept override;
+  int enqueue(uint32_t port_id, packet_ptr pkt) noexcept override;
+  int enqueue(uint32_t port_id, const uint8_t *frame,
+              size_t len) noexcept override;
+
+  /**
+   * @brief tx counters of all taps by port_id
+   */
+  void get_tx_stats(std::map<uint32_t, tap_io::tx_stats> &stats);
+
+  /**
+   * @brief frames read from all taps
+   */
+  void get_rx_stats(tap_io::rx_stats &stats);
 
   // tap_callback
-  int enqueue_to_switch(uint32_t port_id, rofl::cpacket *) override;
+  int enqueue_to_switch(uint32_t port_id, packet_ptr pkt) override;
+  int flood_to_switch(const std::vector<uint32_t> &port_ids,
+                      packet_ptr pkt) override;
 };
 
 } // namespace rofcore
@@ -0,0 +1,142 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+namespace rofcore {
+
+class cpacketpool;
+
+/**
+ * @brief struct virtio_net_hdr preceding frames on taps with IFF_VNET_HDR
+ *
+ * linux/virtio_net.h cannot be included from C++. Fields are in host byte
+ * order.
+ */
+struct virtio_net_hdr {
+  static const uint8_t F_NEEDS_CSUM = 1;
+  static const uint8_t GSO_NONE = 0;
+  static const uint8_t GSO_TCPV4 = 1;
+  static const uint8_t GSO_UDP = 3;
+  static const uint8_t GSO_TCPV6 = 4;
+  static const uint8_t GSO_ECN = 0x80;
+
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;     // ethernet, IP and TCP header
+  uint16_t gso_size;    // payload per segment
+  uint16_t csum_start;  // checksum covers csum_start up to the end
+  uint16_t csum_offset; // of the checksum field after csum_start
+};
+
+/**
+ * @brief frame buffer handed out by cpacketpool
+ *
+ * The descriptor only points into the memory region of the pool, it does not
+ * own the frame data. Every buffer reserves default_headroom bytes in front
+ * of the frame, so headers can be prepended with push() without moving the
+ * frame.
+ */
+class packet {
+public:
+  // fits the OFPT_PACKET_OUT header and an output action, cache line sized
+  static const unsigned int default_headroom = 64;
+
+  uint8_t *soframe() const { return data + offset; }
+
+  size_t length() const { return len; }
+
+  /**
+   * @brief number of bytes available starting at soframe()
+   */
+  size_t capacity() const { return default_headroom + size - offset; }
+
+  /**
+   * @brief number of bytes available in front of soframe()
+   */
+  size_t headroom() const { return offset; }
+
+  void set_length(size_t length) {
+    assert(length <= capacity());
+    len = length;
+  }
+
+  /**
+   * @brief prepend n bytes to the frame
+   *
+   * @return new start of the frame
+   */
+  uint8_t *push(size_t n) {
+    assert(n <= offset);
+    offset -= n;
+    len += n;
+    return soframe();
+  }
+
+  /**
+   * @brief strip n bytes from the start of the frame
+   */
+  uint8_t *pull(size_t n) {
+    assert(n <= len);
+    offset += n;
+    len -= n;
+    return soframe();
+  }
+
+  /**
+   * @brief copy a frame into the buffer, truncates to capacity()
+   */
+  void unpack(const uint8_t *buf, size_t buflen) {
+    len = buflen < capacity() ? buflen : capacity();
+    memcpy(soframe(), buf, len);
+  }
+
+  /**
+   * @brief offload state of a frame read from a tap with IFF_VNET_HDR
+   *
+   * Zeroed unless the checksum has to be finished or the frame has to be
+   * segmented before it is sent out, see gso.hpp.
+   */
+  struct virtio_net_hdr &vnet_hdr() { return vnet; }
+  const struct virtio_net_hdr &vnet_hdr() const { return vnet; }
+
+  void clear() {
+    len = 0;
+    offset = default_headroom;
+    memset(&vnet, 0, sizeof(vnet));
+  }
+
+private:
+  friend class cpacketpool;
+
+  uint8_t *data; // start of the buffer including the headroom
+  uint32_t offset;
+  uint32_t len;
+  uint32_t size; // buffer size excluding the headroom
+  uint32_t size_class;
+  uint64_t t_acquired; // steady clock ns, for the hold time statistics
+  struct virtio_net_hdr vnet;
+};
+
+/**
+ * @brief deleter returning a packet to cpacketpool
+ */
+struct packet_deleter {
+  void operator()(packet *pkt) const;
+};
+
+/**
+ * @brief owning handle of a pool packet
+ *
+ * Move the handle along the punt and inject paths, whoever holds it last
+ * returns the packet to the pool.
+ */
+typedef std::unique_ptr<packet, packet_deleter> packet_ptr;
+
+} // namespace rofcore
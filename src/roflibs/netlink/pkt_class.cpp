@@ -0,0 +1,126 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+
+#include <cstring>
+
+#include "roflibs/netlink/pkt_class.hpp"
+
+namespace rofcore {
+
+namespace {
+
+const uint16_t eth_p_slow = 0x8809; // LACP, marker, OAM
+const uint16_t eth_p_lldp = 0x88cc;
+const uint16_t eth_p_cfm = 0x8902;
+
+const uint16_t port_bgp = 179;
+const uint16_t port_ldp = 646;
+const uint16_t port_bfd = 3784;
+const uint16_t port_bfd_echo = 3785;
+const uint16_t port_bfd_multihop = 4784;
+
+const uint8_t ipproto_ospf = 89;
+const uint8_t ipproto_vrrp = 112;
+
+inline uint16_t get16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+bool is_control_port(uint8_t proto, uint16_t sport, uint16_t dport) {
+  if (proto == IPPROTO_TCP) {
+    return sport == port_bgp || dport == port_bgp || sport == port_ldp ||
+           dport == port_ldp;
+  }
+  if (proto == IPPROTO_UDP) {
+    return dport == port_bfd || dport == port_bfd_echo ||
+           dport == port_bfd_multihop || dport == port_ldp;
+  }
+  return false;
+}
+
+bool is_control_l4(uint8_t proto, const uint8_t *l4, size_t len) {
+  if (proto == ipproto_ospf || proto == ipproto_vrrp) {
+    return true;
+  }
+  if (len < 4) {
+    return false;
+  }
+  return is_control_port(proto, get16(l4), get16(l4 + 2));
+}
+
+} // namespace
+
+enum pkt_class classify_frame(const uint8_t *frame, size_t len) {
+  if (len < ETH_HLEN) {
+    return PKT_CLASS_BULK;
+  }
+
+  // 01:80:c2:00:00:0x is reserved for STP, slow protocols, LLDP and the
+  // like, 01:80:c2:00:00:14/15 and 09:00:2b:00:00:05 carry IS-IS
+  static const uint8_t ieee_ll[] = {0x01, 0x80, 0xc2, 0x00, 0x00};
+  static const uint8_t isis_all_is[] = {0x09, 0x00, 0x2b, 0x00, 0x00, 0x05};
+  if (memcmp(frame, ieee_ll, sizeof(ieee_ll)) == 0 &&
+      (frame[5] <= 0x0f || frame[5] == 0x14 || frame[5] == 0x15)) {
+    return PKT_CLASS_CONTROL;
+  }
+  if (memcmp(frame, isis_all_is, sizeof(isis_all_is)) == 0) {
+    return PKT_CLASS_CONTROL;
+  }
+
+  size_t off = ETH_HLEN;
+  uint16_t proto = get16(frame + off - 2);
+  for (int tags = 0;
+       tags < 2 && (proto == ETH_P_8021Q || proto == ETH_P_8021AD); tags++) {
+    off += 4;
+    if (len < off) {
+      return PKT_CLASS_BULK;
+    }
+    proto = get16(frame + off - 2);
+  }
+
+  switch (proto) {
+  case eth_p_slow:
+  case eth_p_lldp:
+  case eth_p_cfm:
+    return PKT_CLASS_CONTROL;
+  case ETH_P_IP: {
+    const uint8_t *ip = frame + off;
+    if (len < off + 20) {
+      break;
+    }
+    size_t hlen = (ip[0] & 0x0f) * 4;
+    // only the first fragment carries the ports
+    bool first = (get16(ip + 6) & 0x1fff) == 0;
+    if (len >= off + hlen && first &&
+        is_control_l4(ip[9], ip + hlen, len - off - hlen)) {
+      return PKT_CLASS_CONTROL;
+    }
+  } break;
+  case ETH_P_IPV6: {
+    // extension headers are not followed, the protocols above do not use
+    // them
+    const uint8_t *ip6 = frame + off;
+    if (len >= off + 40 && is_control_l4(ip6[6], ip6 + 40, len - off - 40)) {
+      return PKT_CLASS_CONTROL;
+    }
+  } break;
+  default:
+    break;
+  }
+
+  return PKT_CLASS_BULK;
+}
+
+const char *pkt_class_name(enum pkt_class cls) {
+  switch (cls) {
+  case PKT_CLASS_CONTROL:
+    return "control";
+  case PKT_CLASS_BULK:
+    return "bulk";
+  }
+  return "unknown";
+}
+
+} // namespace rofcore
@@ -0,0 +1,41 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace rofcore {
+
+/**
+ * @brief traffic classes of punted and injected frames, in priority order
+ */
+enum pkt_class {
+  PKT_CLASS_CONTROL, // link-critical protocols, always served first
+  PKT_CLASS_BULK,    // ARP/ND and everything else
+};
+
+static const unsigned int n_pkt_classes = 2;
+
+/**
+ * @brief counters of a traffic class
+ */
+struct class_stats {
+  uint64_t delayed; // waited behind other frames
+  uint64_t dropped;
+};
+
+/**
+ * @brief classify an ethernet frame
+ *
+ * Control are the IEEE link-local protocols (STP, LACP and other slow
+ * protocols, LLDP, CFM), IS-IS, BFD and the keepalives of the routing
+ * protocols (BGP, LDP, OSPF, VRRP), also when carried in up to two VLAN tags.
+ */
+enum pkt_class classify_frame(const uint8_t *frame, size_t len);
+
+const char *pkt_class_name(enum pkt_class cls);
+
+} // namespace rofcore
@@ -0,0 +1,61 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace rofcore {
+
+/**
+ * @brief map from port_id to T for lookups on the packet path
+ *
+ * Port ids below max_dense_port, which covers the physical ports, are looked
+ * up by index, larger ones in a map. Instances are meant to be built once,
+ * published through an atomically swapped std::shared_ptr<const port_index>
+ * and copied for updates.
+ */
+template <typename T> class port_index {
+public:
+  static const uint32_t max_dense_port = 4096;
+
+  const T *find(uint32_t port_id) const {
+    if (port_id < dense.size())
+      return present[port_id] ? &dense[port_id] : nullptr;
+    auto it = sparse.find(port_id);
+    return it != sparse.end() ? &it->second : nullptr;
+  }
+
+  /**
+   * @brief entry of port_id, added if missing
+   */
+  T &set(uint32_t port_id) {
+    if (port_id >= max_dense_port)
+      return sparse[port_id];
+    if (port_id >= dense.size()) {
+      dense.resize(port_id + 1);
+      present.resize(port_id + 1, false);
+    }
+    present[port_id] = true;
+    return dense[port_id];
+  }
+
+  void erase(uint32_t port_id) {
+    if (port_id < dense.size()) {
+      dense[port_id] = T();
+      present[port_id] = false;
+    } else {
+      sparse.erase(port_id);
+    }
+  }
+
+private:
+  std::vector<T> dense;
+  std::vector<bool> present;
+  std::map<uint32_t, T> sparse;
+};
+
+} // namespace rofcore
@@ -2,9 +2,11 @@
 
 #include <cinttypes>
 #include <deque>
+#include <vector>
 
 #include <rofl/common/caddress.h>
-#include <rofl/common/cpacket.h>
+
+#include "roflibs/netlink/packet.hpp"
 
 namespace rofcore {
 class switch_interface {
@@ -35,7 +37,13 @@ public:
   virtual int egress_port_vlan_remove(uint32_t port, uint16_t vid,
                                       bool untagged) noexcept = 0;
 
-  virtual int enqueue(uint32_t port_id, rofl::cpacket *pkt) noexcept = 0;
+  virtual int enqueue(uint32_t port_id, packet_ptr pkt) noexcept = 0;
+
+  /**
+   * @brief send a frame the kernel wrote to each port of port_ids
+   */
+  virtual int flood(const std::vector<uint32_t> &port_ids,
+                    packet_ptr pkt) noexcept = 0;
   virtual int subscribe_to(enum swi_flags flags) noexcept = 0;
 };
 
@@ -60,6 +68,15 @@ public:
   port_notification(std::deque<port_notification_data> &) noexcept = 0;
   virtual void port_status_changed(uint32_t port,
                                    enum port_status) noexcept = 0;
-  virtual int enqueue(uint32_t port_id, rofl::cpacket *pkt) noexcept = 0;
+  virtual int enqueue(uint32_t port_id, packet_ptr pkt) noexcept = 0;
+
+  /**
+   * @brief send a frame not owned by the caller to the tap of port_id
+   *
+   * The frame is written directly if possible, otherwise it is copied into a
+   * pool packet. frame is not accessed after the call returned.
+   */
+  virtual int enqueue(uint32_t port_id, const uint8_t *frame,
+                      size_t len) noexcept = 0;
 };
 } // namespace rofcore
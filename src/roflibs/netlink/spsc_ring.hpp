@@ -0,0 +1,98 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace rofcore {
+
+/**
+ * @brief bounded lock-free single-producer/single-consumer ring
+ *
+ * Elements are moved in and out. Each side caches the cursor of the other
+ * side and only reloads it when the ring looks full or empty.
+ */
+template <typename T> class spsc_ring {
+public:
+  /**
+   * @param capacity minimum number of slots, rounded up to a power of two
+   */
+  explicit spsc_ring(size_t capacity)
+      : mask(round_up(capacity) - 1), slots(new T[mask + 1]), head(0),
+        cached_tail(0), tail(0), cached_head(0) {}
+
+  size_t capacity() const { return mask + 1; }
+
+  /**
+   * @brief append val to the ring, producer only
+   *
+   * @return false in case the ring is full, val is left untouched
+   */
+  bool push(T &&val) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - cached_head > mask) {
+      cached_head = head.load(std::memory_order_acquire);
+      if (t - cached_head > mask)
+        return false;
+    }
+    slots[t & mask] = std::move(val);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief remove the oldest element from the ring, consumer only
+   *
+   * @return false in case the ring is empty
+   */
+  bool pop(T &val) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == cached_tail) {
+      cached_tail = tail.load(std::memory_order_acquire);
+      if (h == cached_tail)
+        return false;
+    }
+    val = std::move(slots[h & mask]);
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief exact on either side as long as the other one is idle
+   */
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
+
+private:
+  spsc_ring(const spsc_ring &) = delete;
+  spsc_ring &operator=(const spsc_ring &) = delete;
+
+  static size_t round_up(size_t v) {
+    size_t r = 1;
+    while (r < v)
+      r <<= 1;
+    return r;
+  }
+
+  const size_t mask;
+  std::unique_ptr<T[]> slots;
+
+  // consumer and producer state on separate cache lines, padding is used
+  // instead of alignas() as rings are heap allocated
+  char pad0[64];
+  std::atomic<size_t> head;
+  size_t cached_tail;
+  char pad1[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+  std::atomic<size_t> tail;
+  size_t cached_head;
+  char pad2[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+};
+
+} // namespace rofcore
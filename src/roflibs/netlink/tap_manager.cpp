@@ -2,150 +2,934 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <linux/if_ether.h>
+#include <linux/if_tun.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+
 #include <glog/logging.h>
 #include "roflibs/netlink/tap_manager.hpp"
 #include "roflibs/netlink/cpacketpool.hpp"
 
 namespace rofcore {
 
-static inline void
-release_packets(std::deque<std::pair<int, rofl::cpacket *>> &q) {
-  for (auto i : q) {
-    cpacketpool::get_instance().release_pkt(i.second);
+static std::atomic<uint64_t> next_tap_io_id(0);
+
+tap_io::tap_io(const tap_config &cfg)
+    : cfg(cfg), id(++next_tap_io_id), thread(this), next_serial(0),
+      tx_scheduled(false), rx_scheduled(false), rx_paused(false), rx_resume(false) {
+  for (unsigned int c = 0; c < n_pkt_classes; c++) {
+    rx_delayed[c].store(0, std::memory_order_relaxed);
+    rx_dropped[c].store(0, std::memory_order_relaxed);
+  }
+  if (cfg.io_uring) {
+    uring = tap_uring::create(uring_entries);
+    if (uring) {
+      thread.add_read_fd(uring->get_event_fd(), true, false);
+    } else {
+      LOG(WARNING) << __FUNCTION__ << ": falling back to read()/write()";
+    }
+  }
+  if (cfg.vnet_hdr && not uring) {
+    rx_spill.resize(cpacketpool::size_classes[cpacketpool::n_size_classes - 1]);
   }
+  thread.start("tap_io");
 }
 
-tap_io::~tap_io() { thread.stop(); }
+tap_io::~tap_io() {
+  cpacketpool::get_instance().cancel_wait(this);
+  thread.stop();
+}
 
-void tap_io::register_tap(int fd, uint32_t port_id, switch_callback &cb) {
+void tap_io::register_tap(int fd, uint32_t port_id, switch_callback &cb,
+                          std::unique_ptr<tap_tpacket> ring) {
+  {
+    std::lock_guard<std::mutex> guard(tx_mutex);
+    tx_queues.emplace(std::piecewise_construct, std::forward_as_tuple(fd),
+                      std::forward_as_tuple(++next_serial));
+  }
   {
     std::lock_guard<std::mutex> guard(events_mutex);
-    events.emplace_back(std::make_tuple(TAP_IO_ADD, fd, port_id, &cb));
+    events.emplace_back(
+        std::make_tuple(TAP_IO_ADD, fd, port_id, &cb, 0, std::move(ring)));
   }
 
   thread.wakeup();
 }
 
 void tap_io::unregister_tap(int fd, uint32_t port_id) {
+  std::deque<packet_ptr> dropped[n_pkt_classes];
+  {
+    std::lock_guard<std::mutex> guard(tx_mutex);
+    auto it = tx_queues.find(fd);
+    if (it != tx_queues.end()) {
+      for (unsigned int c = 0; c < n_pkt_classes; c++)
+        std::swap(dropped[c], it->second.pkts[c]);
+      tx_queues.erase(it);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> guard(events_mutex);
+    events.emplace_back(
+        std::make_tuple(TAP_IO_REM, fd, port_id, nullptr, 0, nullptr));
+  }
+
+  thread.wakeup();
+}
+
+void tap_io::set_mtu(int fd, unsigned int mtu) {
   {
     std::lock_guard<std::mutex> guard(events_mutex);
-    events.emplace_back(std::make_tuple(TAP_IO_REM, fd, port_id, nullptr));
+    events.emplace_back(
+        std::make_tuple(TAP_IO_MTU, fd, 0, nullptr, mtu, nullptr));
   }
 
   thread.wakeup();
 }
 
-void tap_io::enqueue(int fd, rofl::cpacket *pkt) {
-  if (fd == -1) {
-    cpacketpool::get_instance().release_pkt(pkt);
+void tap_io::set_link_state(int fd, bool up) {
+  std::deque<packet_ptr> dropped[n_pkt_classes];
+  {
+    std::lock_guard<std::mutex> guard(tx_mutex);
+    auto it = tx_queues.find(fd);
+    if (it == tx_queues.end()) {
+      return;
+    }
+
+    tx_queue &q = it->second;
+    q.link_up = up;
+    for (unsigned int c = 0; c < n_pkt_classes && not up; c++) {
+      q.stats.dropped_link_down += q.pkts[c].size();
+      q.stats.classes[c].dropped += q.pkts[c].size();
+      q.pending -= q.pkts[c].size();
+      std::swap(dropped[c], q.pkts[c]);
+    }
+  }
+  VLOG(1) << __FUNCTION__ << ": fd=" << fd << " link " << (up ? "up" : "down");
+}
+
+bool tap_io::get_tx_stats(int fd, tx_stats &stats) {
+  std::lock_guard<std::mutex> guard(tx_mutex);
+  auto it = tx_queues.find(fd);
+  if (it == tx_queues.end()) {
+    return false;
+  }
+  stats = it->second.stats;
+  stats.queued = it->second.n_queued();
+  return true;
+}
+
+void tap_io::get_rx_stats(rx_stats &stats) {
+  for (unsigned int c = 0; c < n_pkt_classes; c++) {
+    stats.classes[c].delayed = rx_delayed[c].load(std::memory_order_relaxed);
+    stats.classes[c].dropped = rx_dropped[c].load(std::memory_order_relaxed);
+  }
+}
+
+tap_io::tx_ring &tap_io::producer_ring() {
+  // rings of the tap_io instances this thread produced for, by id
+  static thread_local std::vector<std::pair<uint64_t, tx_ring *>> rings;
+
+  for (auto &r : rings) {
+    if (r.first == id)
+      return *r.second;
+  }
+
+  std::lock_guard<std::mutex> guard(tx_mutex);
+  tx_rings.emplace_back(new tx_ring(tx_ring_len));
+  rings.emplace_back(id, tx_rings.back().get());
+  VLOG(1) << __FUNCTION__ << ": new producer tid=" << pthread_self()
+          << " n_producers=" << tx_rings.size();
+  return *tx_rings.back();
+}
+
+void tap_io::enqueue(int fd, packet_ptr pkt) {
+  enum pkt_class cls = classify_frame(pkt->soframe(), pkt->length());
+
+  if (cfg.vnet_hdr) {
+    // no offloads towards the host
+    memset(pkt->push(sizeof(struct virtio_net_hdr)), 0,
+           sizeof(struct virtio_net_hdr));
+  }
+
+  // link state and queue limits are applied once tx() drains the ring
+  if (not producer_ring().push(tx_req{fd, cls, std::move(pkt)})) {
+    LOG_EVERY_N(WARNING, 1000) << __FUNCTION__
+                               << ": tx ring full, dropping packet to fd="
+                               << fd;
+    // tx() is lagging behind, taking the lock only on this path is fine
+    std::lock_guard<std::mutex> guard(tx_mutex);
+    auto it = tx_queues.find(fd);
+    if (it != tx_queues.end()) {
+      it->second.stats.dropped_ring++;
+      it->second.stats.classes[cls].dropped++;
+    }
     return;
   }
 
+  // a single wakeup serves all packets pushed until tx() runs
+  if (not tx_scheduled.exchange(true)) {
+    thread.wakeup();
+  }
+}
+
+void tap_io::drain_tx_rings(std::deque<packet_ptr> &dropped) {
+  tx_req req;
+
+  for (auto &ring : tx_rings) {
+    while (ring->pop(req)) {
+      auto it = tx_queues.find(req.fd);
+      if (it == tx_queues.end()) {
+        VLOG(1) << __FUNCTION__ << ": dropping packet to unknown fd=" << req.fd;
+        dropped.push_back(std::move(req.pkt));
+        continue;
+      }
+
+      tx_queue &q = it->second;
+      std::deque<packet_ptr> &pkts = q.pkts[req.cls];
+      class_stats &cs = q.stats.classes[req.cls];
+      if (not q.link_up) {
+        q.stats.dropped_link_down++;
+        cs.dropped++;
+        dropped.push_back(std::move(req.pkt));
+        continue;
+      }
+
+      // every class has its own limit, bulk traffic cannot crowd out
+      // control frames
+      if (pkts.size() >= cfg.tx_queue_len) {
+        q.stats.dropped_full++;
+        cs.dropped++;
+        if (not cfg.tx_drop_oldest) {
+          dropped.push_back(std::move(req.pkt));
+          continue;
+        }
+        dropped.push_back(std::move(pkts.front()));
+        pkts.pop_front();
+        q.pending--;
+      }
+
+      if (q.pending)
+        cs.delayed++;
+      pkts.push_back(std::move(req.pkt));
+      q.pending++;
+    }
+  }
+}
+
+int tap_io::enqueue(int fd, const uint8_t *frame, size_t len) {
+  tx_ring &ring = producer_ring();
+  bool direct = false;
   {
-    // store pkt in outgoing queue
-    std::lock_guard<std::mutex> guard(pout_queue_mutex);
-    pout_queue.emplace_back(std::make_pair(fd, pkt));
+    std::lock_guard<std::mutex> guard(tx_mutex);
+    auto it = tx_queues.find(fd);
+    if (it == tx_queues.end()) {
+      return -EBADF;
+    }
+
+    tx_queue &q = it->second;
+    if (not q.link_up) {
+      q.stats.dropped_link_down++;
+      q.stats.classes[classify_frame(frame, len)].dropped++;
+      return -ENETDOWN;
+    }
+
+    // the ring is only drained with tx_mutex held. Once it is empty and
+    // nothing is pending for fd, packets of this thread cannot overtake the
+    // frame. vhost-net only takes frames from pool packets posted by the
+    // tap_io thread, and with uring the fds are blocking, so in both cases
+    // the frame is always copied and queued.
+    direct = (not cfg.vhost && not uring && q.pending == 0 && ring.empty());
+  }
+
+  if (direct) {
+    ssize_t rv;
+    if (cfg.vnet_hdr) {
+      static const struct virtio_net_hdr vnet = {};
+      struct iovec iov[2] = {{(void *)&vnet, sizeof(vnet)},
+                             {(void *)frame, len}};
+      rv = writev(fd, iov, 2);
+    } else {
+      rv = write(fd, frame, len);
+    }
+    if (rv >= 0) {
+      return 0;
+    }
+
+    if (errno != EAGAIN) {
+      if (errno == EIO) {
+        // tap not enabled drop packet
+        VLOG(1) << __FUNCTION__ << ": EIO";
+      } else {
+        LOG(ERROR) << __FUNCTION__ << ": write to fd=" << fd
+                   << " failed: " << strerror(errno);
+      }
+      std::lock_guard<std::mutex> guard(tx_mutex);
+      auto it = tx_queues.find(fd);
+      if (it != tx_queues.end()) {
+        it->second.stats.dropped_error++;
+      }
+      return -EIO;
+    }
+  }
+
+  packet_ptr pkt = cpacketpool::get_instance().try_acquire_pkt(len);
+  if (pkt == nullptr) {
+    VLOG(1) << __FUNCTION__ << ": packet pool exhausted, dropping frame";
+    return -ENOBUFS;
   }
+  pkt->unpack(frame, len);
+  enqueue(fd, std::move(pkt));
+  return 0;
+}
+
+void tap_io::pkts_available() {
+  // called on a foreign thread
+  rx_resume.store(true);
   thread.wakeup();
 }
 
+void tap_io::pause_rx(size_t frame_size) {
+  if (rx_paused)
+    return;
+
+  LOG(WARNING) << __FUNCTION__
+               << ": packet pool exhausted, suspending reads from taps";
+  rx_paused = true;
+  for (auto &port : sw_cbs) {
+    // with uring and vhost the buffers already posted stay pending
+    if (not uring && not port.second.vhost && not port.second.active)
+      thread.drop_read_fd(rx_fd(port.first, port.second), false);
+  }
+  cpacketpool::get_instance().wait_for_pkts(this, frame_size);
+}
+
+void tap_io::resume_rx() {
+  if (not rx_paused)
+    return;
+
+  LOG(INFO) << __FUNCTION__ << ": packets available, resuming reads from taps";
+  rx_paused = false;
+  for (auto &port : sw_cbs) {
+    if (uring)
+      uring_post_reads(port.first, port.second);
+    else if (port.second.vhost)
+      vhost_post_rx(port.second);
+    else if (not port.second.active)
+      thread.add_read_fd(rx_fd(port.first, port.second), true, false);
+  }
+  if (uring)
+    uring->submit();
+}
+
+void tap_io::uring_post_reads(int fd, tap_port &port) {
+  size_t size =
+      port.frame_size + (cfg.vnet_hdr ? sizeof(struct virtio_net_hdr) : 0);
+
+  while (port.n_reads < uring_rx_depth && not rx_paused) {
+    packet_ptr pkt = cpacketpool::get_instance().try_acquire_pkt(size);
+    if (pkt == nullptr) {
+      pause_rx(size);
+      return;
+    }
+    if (not uring->read(fd, port.serial, std::move(pkt))) {
+      LOG(ERROR) << __FUNCTION__ << ": failed to post read on fd=" << fd;
+      return;
+    }
+    port.n_reads++;
+  }
+}
+
+void tap_io::uring_complete() {
+  std::deque<tap_uring::completion> done;
+  bool reschedule = false;
+
+  uring->reap(done);
+  for (auto &c : done) {
+    if (c.op == tap_uring::TAP_URING_READ) {
+      auto it = sw_cbs.find(c.fd);
+      if (it == sw_cbs.end() || it->second.serial != c.tag) {
+        // tap was removed
+        continue;
+      }
+
+      tap_port &port = it->second;
+      port.n_reads--;
+      if (c.res > 0) {
+        VLOG(3) << __FUNCTION__ << ": read " << c.res << " bytes from fd="
+                << c.fd << " into pkt=" << c.pkt.get();
+        c.pkt->set_length(c.res);
+        if (not cfg.vnet_hdr || pull_vnet_hdr(*c.pkt))
+          rx_queue(port, std::move(c.pkt));
+      } else if (c.res < 0 && c.res != -ECANCELED) {
+        LOG(ERROR) << __FUNCTION__ << ": read from fd=" << c.fd
+                   << " failed: " << strerror(-c.res);
+        if (c.res == -EBADF)
+          continue;
+      }
+      uring_post_reads(c.fd, port);
+    } else {
+      std::lock_guard<std::mutex> guard(tx_mutex);
+      auto it = tx_queues.find(c.fd);
+      if (it == tx_queues.end() || it->second.serial != c.tag) {
+        continue;
+      }
+
+      tx_queue &q = it->second;
+      q.pending--;
+      if (c.res < 0) {
+        // the remaining writes of a failed chain are cancelled
+        VLOG(1) << __FUNCTION__ << ": write to fd=" << c.fd
+                << " failed: " << strerror(-c.res);
+        q.stats.dropped_error++;
+      }
+      if (--q.n_inflight == 0) {
+        q.blocked = false;
+        reschedule |= q.n_queued() > 0;
+      }
+    }
+  }
+  rx_flush();
+  uring->submit();
+
+  if (reschedule)
+    tx();
+}
+
+void tap_io::vhost_post_rx(tap_port &port) {
+  size_t size = port.frame_size + sizeof(struct virtio_net_hdr);
+  bool posted = false;
+
+  while (port.vhost->rx_room() && not rx_paused) {
+    packet_ptr pkt = cpacketpool::get_instance().try_acquire_pkt(size);
+    if (pkt == nullptr) {
+      pause_rx(size);
+      break;
+    }
+    port.vhost->post_rx(std::move(pkt));
+    posted = true;
+  }
+  if (posted)
+    port.vhost->kick_rx();
+}
+
+void tap_io::vhost_complete(int fd, tap_port &port) {
+  std::deque<packet_ptr> pkts;
+  bool reschedule = false;
+
+  port.vhost->ack_event();
+  port.vhost->reap_rx(pkts);
+  for (auto &pkt : pkts) {
+    VLOG(3) << __FUNCTION__ << ": received " << pkt->length()
+            << " bytes from fd=" << fd << " in pkt=" << pkt.get();
+    rx_queue(port, std::move(pkt));
+  }
+  rx_flush();
+  vhost_post_rx(port);
+
+  size_t n_done = port.vhost->reap_tx();
+  if (n_done) {
+    std::lock_guard<std::mutex> guard(tx_mutex);
+    auto it = tx_queues.find(fd);
+    if (it != tx_queues.end() && it->second.serial == port.serial) {
+      tx_queue &q = it->second;
+      q.pending -= n_done;
+      q.n_inflight -= n_done;
+      if (q.blocked) {
+        // descriptors are available again
+        q.blocked = false;
+        reschedule = q.n_queued() > 0;
+      }
+    }
+  }
+
+  if (reschedule)
+    tx();
+}
+
 void tap_io::handle_read_event(rofl::cthread &thread, int fd) {
-  rofl::cpacket *pkt = nullptr;
-  try {
-    pkt = cpacketpool::get_instance().acquire_pkt();
-
-    ssize_t n_bytes = read(fd, pkt->soframe(), pkt->length());
-
-    // error occured (or non-blocking)
-    if (n_bytes < 0) {
-      switch (errno) {
-      case EAGAIN:
-        LOG(ERROR) << __FUNCTION__
-                   << ": EAGAIN XXX not implemented packet is dropped";
-        cpacketpool::get_instance().release_pkt(pkt);
-      default:
-        LOG(ERROR) << __FUNCTION__ << ": unknown error occured";
-        cpacketpool::get_instance().release_pkt(pkt);
+  if (uring && fd == uring->get_event_fd()) {
+    uring_complete();
+    return;
+  }
+
+  auto r = rx_fds.find(fd);
+  int tap_fd = (r != rx_fds.end()) ? r->second : fd;
+  auto it = sw_cbs.find(tap_fd);
+  if (it == sw_cbs.end()) {
+    LOG(ERROR) << __FUNCTION__ << ": read event on unknown fd=" << fd;
+    return;
+  }
+
+  if (it->second.vhost) {
+    vhost_complete(tap_fd, it->second);
+    return;
+  }
+
+  // the port is polled again once it was drained by rx()
+  if (not it->second.active) {
+    thread.drop_read_fd(fd, false);
+    it->second.active = true;
+    it->second.deficit = 0;
+    it->second.in_turn = false;
+    rx_active.push_back(tap_fd);
+  }
+
+  // read once all ports readable in this poll round are active, so
+  // rx_coalesce() sees the flood copies of all of them
+  if (not rx_scheduled) {
+    rx_scheduled = true;
+    thread.wakeup();
+  }
+}
+
+void tap_io::rx() {
+  unsigned int budget = rx_budget;
+
+  while (budget && not rx_active.empty() && not rx_paused) {
+    int fd = rx_active.front();
+    rx_active.pop_front();
+    tap_port &port = sw_cbs.at(fd);
+    bool drained = false;
+
+    // a turn cut short by the budget or an exhausted pool is continued
+    // without crediting the quantum again
+    if (not port.in_turn) {
+      port.deficit += rx_quantum;
+      port.in_turn = true;
+    }
+    while (port.deficit > 0 && budget) {
+      packet_ptr pkt =
+          cpacketpool::get_instance().try_acquire_pkt(port.frame_size);
+      if (pkt == nullptr) {
+        // leave the frames in the tap until buffers are returned
+        rx_active.push_front(fd);
+        pause_rx(port.frame_size);
+        rx_flush();
+        return;
+      }
+
+      ssize_t n_bytes;
+      if (port.ring)
+        n_bytes = port.ring->read(pkt->soframe(), pkt->capacity());
+      else if (cfg.vnet_hdr)
+        n_bytes = read_vnet(fd, pkt);
+      else
+        n_bytes = read(fd, pkt->soframe(), pkt->capacity());
+      if (n_bytes < 0) {
+        if (errno != EAGAIN) {
+          LOG(ERROR) << __FUNCTION__ << ": read from fd=" << fd
+                     << " failed: " << strerror(errno);
+        }
+        drained = true;
+        break;
       }
+
+      VLOG(3) << __FUNCTION__ << ": read " << n_bytes << " bytes from fd=" << fd
+              << " into pkt=" << pkt.get();
+      --budget;
+      port.deficit -= n_bytes;
+      if (pkt == nullptr) {
+        // GSO frame dropped by read_vnet()
+        continue;
+      }
+      pkt->set_length(n_bytes);
+      rx_queue(port, std::move(pkt));
+    }
+
+    if (drained) {
+      // unused credit is not carried over to the next burst
+      port.active = false;
+      port.deficit = 0;
+      port.in_turn = false;
+      thread.add_read_fd(rx_fd(fd, port), true, false);
+    } else if (port.deficit > 0) {
+      // budget exceeded, the port goes first in the next round
+      rx_active.push_front(fd);
     } else {
-      VLOG(1) << __FUNCTION__ << ": read " << n_bytes << " bytes from fd=" << fd
-              << " into pkt=" << pkt << " tid=" << pthread_self();
-      // std::map<int, std::pair<uint32_t, switch_callback *>> sw_cbs;
-      std::pair<uint32_t, switch_callback *> &cb = sw_cbs.at(fd);
-      cb.second->enqueue_to_switch(cb.first, pkt);
+      port.in_turn = false;
+      rx_active.push_back(fd);
     }
+  }
 
-  } catch (ePacketPoolExhausted &e) {
-    LOG(ERROR) << __FUNCTION__
-               << ": packet pool exhausted, no idle slots available";
+  rx_flush();
+
+  // budget exceeded, continue after pending events and writes were handled
+  if (not rx_active.empty() && not rx_paused && not rx_scheduled) {
+    rx_scheduled = true;
+    thread.wakeup();
   }
 }
 
+void tap_io::rx_queue(tap_port &port, packet_ptr pkt) {
+  enum pkt_class cls = classify_frame(pkt->soframe(), pkt->length());
+  rx_pending[cls].push_back(
+      rx_frame{port.port_id, port.cb, std::move(pkt), {}});
+}
+
+void tap_io::rx_flush() {
+  bool sent = false;
+
+  for (unsigned int c = 0; c < n_pkt_classes; c++) {
+    rx_coalesce(rx_pending[c]);
+    for (auto &f : rx_pending[c]) {
+      if (not f.pkt) {
+        // sent along with an earlier copy
+        continue;
+      }
+      size_t n = std::max<size_t>(f.flood_ports.size(), 1);
+      if (sent)
+        rx_delayed[c].fetch_add(n, std::memory_order_relaxed);
+      int rv = f.flood_ports.empty()
+                   ? f.cb->enqueue_to_switch(f.port_id, std::move(f.pkt))
+                   : f.cb->flood_to_switch(f.flood_ports, std::move(f.pkt));
+      if (rv < 0)
+        rx_dropped[c].fetch_add(n, std::memory_order_relaxed);
+    }
+    sent |= not rx_pending[c].empty();
+    rx_pending[c].clear();
+  }
+}
+
+void tap_io::rx_coalesce(std::deque<rx_frame> &frames) {
+  if (frames.size() < 2) {
+    return;
+  }
+
+  // the bridge floods broadcasts and unknown unicasts by writing the same
+  // frame to every member tap, copies read in one round are merged into
+  // their first one, found by a hash over the start of the frame. Copies
+  // read by different tap_io threads are sent separately.
+  std::unordered_map<uint64_t, size_t> first;
+  for (size_t i = 0; i < frames.size(); i++) {
+    rx_frame &f = frames[i];
+    const packet &pkt = *f.pkt;
+    if (pkt.vnet_hdr().flags ||
+        pkt.vnet_hdr().gso_type != virtio_net_hdr::GSO_NONE) {
+      continue;
+    }
+
+    uint64_t hash = 14695981039346656037ULL ^ pkt.length();
+    for (size_t j = 0; j < std::min<size_t>(pkt.length(), 64); j++) {
+      hash = (hash ^ pkt.soframe()[j]) * 1099511628211ULL;
+    }
+
+    auto it = first.emplace(hash, i);
+    if (it.second) {
+      continue;
+    }
+
+    rx_frame &orig = frames[it.first->second];
+    if (orig.cb != f.cb || orig.pkt->length() != pkt.length() ||
+        memcmp(orig.pkt->soframe(), pkt.soframe(), pkt.length()) != 0) {
+      continue;
+    }
+    if (orig.flood_ports.empty()) {
+      orig.flood_ports.push_back(orig.port_id);
+    }
+    if (std::find(orig.flood_ports.begin(), orig.flood_ports.end(),
+                  f.port_id) != orig.flood_ports.end()) {
+      // sent twice to the same port, not a flood
+      continue;
+    }
+    orig.flood_ports.push_back(f.port_id);
+    f.pkt.reset();
+  }
+}
+
+ssize_t tap_io::read_vnet(int fd, packet_ptr &pkt) {
+  struct virtio_net_hdr vnet;
+  size_t cap = pkt->capacity();
+  size_t spill = rx_spill.size() > cap ? rx_spill.size() - cap : 0;
+  struct iovec iov[3] = {{&vnet, sizeof(vnet)},
+                         {pkt->soframe(), cap},
+                         {rx_spill.data(), spill}};
+
+  ssize_t n_bytes = readv(fd, iov, 3);
+  if (n_bytes < 0) {
+    return n_bytes;
+  }
+  n_bytes = std::max(n_bytes - (ssize_t)sizeof(vnet), (ssize_t)0);
+
+  if ((size_t)n_bytes > cap) {
+    // GSO frames are rare, copy them instead of reading every frame into a
+    // buffer of the largest size class
+    packet_ptr big = cpacketpool::get_instance().try_acquire_pkt(n_bytes);
+    if (big == nullptr) {
+      VLOG(1) << __FUNCTION__ << ": packet pool exhausted, dropping "
+              << n_bytes << " bytes GSO frame from fd=" << fd;
+      pkt.reset();
+      return n_bytes;
+    }
+    memcpy(big->soframe(), pkt->soframe(), cap);
+    memcpy(big->soframe() + cap, rx_spill.data(), n_bytes - cap);
+    pkt = std::move(big);
+  }
+  pkt->vnet_hdr() = vnet;
+  return n_bytes;
+}
+
+bool tap_io::pull_vnet_hdr(packet &pkt) {
+  if (pkt.length() < sizeof(struct virtio_net_hdr)) {
+    return false;
+  }
+  memcpy(&pkt.vnet_hdr(), pkt.soframe(), sizeof(struct virtio_net_hdr));
+  pkt.pull(sizeof(struct virtio_net_hdr));
+  return true;
+}
+
 void tap_io::handle_write_event(rofl::cthread &thread, int fd) {
   thread.drop_write_fd(fd);
+  {
+    std::lock_guard<std::mutex> guard(tx_mutex);
+    auto it = tx_queues.find(fd);
+    if (it != tx_queues.end()) {
+      it->second.blocked = false;
+    }
+  }
   tx();
 }
 
 void tap_io::tx() {
-  std::pair<int, rofl::cpacket *> pkt;
-  std::deque<std::pair<int, rofl::cpacket *>> out_queue;
+  struct out_queue {
+    int fd;
+    uint64_t serial;
+    std::deque<packet_ptr> pkts[n_pkt_classes];
+    size_t n_written;
+    int err;
+    tap_vhost *vhost;
+
+    // keep the order, packets queued in the meantime go last
+    size_t requeue(tx_queue &q) {
+      size_t n = 0;
+      for (unsigned int c = 0; c < n_pkt_classes; c++) {
+        n += pkts[c].size();
+        std::move(pkts[c].rbegin(), pkts[c].rend(),
+                  std::front_inserter(q.pkts[c]));
+        pkts[c].clear();
+      }
+      return n;
+    }
+  };
+  std::deque<out_queue> out_queues;
+  std::deque<packet_ptr> dropped;
 
+  tx_scheduled.store(false);
   {
-    std::lock_guard<std::mutex> guard(pout_queue_mutex);
-    std::swap(out_queue, pout_queue);
-  }
-
-  while (not out_queue.empty()) {
-
-    pkt = out_queue.front();
-    int rc = 0;
-    if ((rc = write(pkt.first, pkt.second->soframe(), pkt.second->length())) <
-        0) {
-      switch (errno) {
-      case EAGAIN:
-        VLOG(1) << __FUNCTION__ << ": EAGAIN";
-        {
-          std::lock_guard<std::mutex> guard(pout_queue_mutex);
-          std::move(out_queue.rbegin(), out_queue.rend(),
-                    std::front_inserter(pout_queue));
-        }
-        thread.add_write_fd(pkt.first, true, false);
-        return;
-      case EIO:
-        // tap not enabled drop packet
-        VLOG(1) << __FUNCTION__ << ": EIO";
-        release_packets(out_queue);
-        return;
-      default:
-        // will drop packets
-        release_packets(out_queue);
-        LOG(ERROR) << __FUNCTION__ << ": unknown error occured rc=" << rc
-                   << " errno=" << errno << " '" << strerror(errno);
-        return;
+    std::lock_guard<std::mutex> guard(tx_mutex);
+    drain_tx_rings(dropped);
+    for (auto &q : tx_queues) {
+      if (q.second.blocked || q.second.n_queued() == 0)
+        continue;
+      out_queues.emplace_back();
+      out_queues.back().fd = q.first;
+      out_queues.back().serial = q.second.serial;
+      for (unsigned int c = 0; c < n_pkt_classes; c++)
+        std::swap(out_queues.back().pkts[c], q.second.pkts[c]);
+      if (uring) {
+        // a single chain of writes in flight per tap keeps the order
+        q.second.blocked = true;
+      }
+    }
+  }
+
+  if (out_queues.empty())
+    return;
+
+  if (uring) {
+    bool retry = false;
+    for (auto &out : out_queues) {
+      // strict priority, lower classes wait while a higher one is left over
+      out.n_written = 0;
+      for (unsigned int c = 0; c < n_pkt_classes; c++) {
+        out.n_written += uring->write(out.fd, out.serial, out.pkts[c]);
+        if (not out.pkts[c].empty())
+          break;
+      }
+    }
+    uring->submit();
+
+    // pending is decremented once the writes completed
+    std::lock_guard<std::mutex> guard(tx_mutex);
+    for (auto &out : out_queues) {
+      auto it = tx_queues.find(out.fd);
+      if (it == tx_queues.end() || it->second.serial != out.serial) {
+        continue;
+      }
+
+      tx_queue &q = it->second;
+      q.n_inflight += out.n_written;
+      // the ring was full, queue the rest again
+      out.requeue(q);
+      if (q.n_inflight == 0) {
+        q.blocked = false;
+        retry = true;
+      }
+    }
+    if (retry) {
+      thread.wakeup();
+    }
+    return;
+  }
+
+  for (auto &out : out_queues) {
+    auto port = sw_cbs.find(out.fd);
+    out.vhost = (port != sw_cbs.end() && port->second.serial == out.serial)
+                    ? port->second.vhost.get()
+                    : nullptr;
+    out.n_written = 0;
+    out.err = 0;
+    for (unsigned int c = 0; c < n_pkt_classes; c++) {
+      std::deque<packet_ptr> &pkts = out.pkts[c];
+      if (out.vhost) {
+        out.n_written += out.vhost->write(pkts);
+      } else {
+        out.n_written += write_batch(out.fd, pkts, out.err);
+      }
+      if (not pkts.empty())
+        break;
+    }
+    if (out.vhost)
+      continue;
+
+    if (out.err == EAGAIN) {
+      VLOG(1) << __FUNCTION__ << ": EAGAIN on fd=" << out.fd;
+    } else if (out.err == EIO) {
+      // tap not enabled drop packets
+      VLOG(1) << __FUNCTION__ << ": EIO on fd=" << out.fd;
+    } else if (out.err) {
+      LOG(ERROR) << __FUNCTION__ << ": write to fd=" << out.fd
+                 << " failed: " << strerror(out.err);
+    }
+  }
+
+  // packets not written are released with out_queues after the lock
+  std::lock_guard<std::mutex> guard(tx_mutex);
+  for (auto &out : out_queues) {
+    auto it = tx_queues.find(out.fd);
+    if (it == tx_queues.end()) {
+      // tap was removed in the meantime
+      continue;
+    }
+
+    tx_queue &q = it->second;
+    if (out.vhost) {
+      // pending is decremented once the kernel used the buffers
+      q.n_inflight += out.n_written;
+      if (out.requeue(q)) {
+        // no descriptors left, wait for vhost_complete()
+        q.blocked = true;
+      }
+      continue;
+    }
+
+    q.pending -= out.n_written;
+    if (out.err == EAGAIN) {
+      out.requeue(q);
+      q.blocked = true;
+      thread.add_write_fd(out.fd, true, false);
+    } else {
+      for (unsigned int c = 0; c < n_pkt_classes; c++) {
+        q.pending -= out.pkts[c].size();
+        q.stats.dropped_error += out.pkts[c].size();
+        q.stats.classes[c].dropped += out.pkts[c].size();
       }
     }
-    cpacketpool::get_instance().release_pkt(pkt.second);
-    out_queue.pop_front();
   }
 }
 
+size_t tap_io::write_batch(int fd, std::deque<packet_ptr> &pkts, int &err) {
+  size_t n = 0;
+
+  // a tap takes one frame per write(), vectored writes would be merged into
+  // a single frame
+  err = 0;
+  while (not pkts.empty()) {
+    const packet_ptr &pkt = pkts.front();
+    if (write(fd, pkt->soframe(), pkt->length()) < 0) {
+      err = errno;
+      break;
+    }
+    pkts.pop_front();
+    n++;
+  }
+  return n;
+}
+
 void tap_io::handle_events() {
   std::lock_guard<std::mutex> guard(events_mutex);
 
   // register fds
-  for (auto ev : events) {
+  for (auto &ev : events) {
     int fd = std::get<1>(ev);
     switch (std::get<0>(ev)) {
 
-    case TAP_IO_ADD:
-      sw_cbs.emplace(
-          std::make_pair(fd, std::make_pair(std::get<2>(ev), std::get<3>(ev))));
-      thread.add_read_fd(fd, true, false);
-      break;
-    case TAP_IO_REM:
-      thread.drop_fd(fd, false);
+    case TAP_IO_ADD: {
+      uint64_t serial = 0;
+      {
+        std::lock_guard<std::mutex> guard(tx_mutex);
+        auto q = tx_queues.find(fd);
+        if (q != tx_queues.end())
+          serial = q->second.serial;
+      }
+      auto it = sw_cbs.emplace(std::make_pair(
+          fd, tap_port{std::get<2>(ev), std::get<3>(ev),
+                       cpacketpool::default_pkt_size, 0, false, false, serial,
+                       0, std::move(std::get<5>(ev))}));
+      tap_port &port = it.first->second;
+
+      if (cfg.vhost) {
+        // falls back to reading from the tap fd
+        port.vhost = tap_vhost::create(fd);
+      }
+      if (port.ring || port.vhost) {
+        rx_fds[rx_fd(fd, port)] = fd;
+      }
+
+      if (port.vhost) {
+        thread.add_read_fd(rx_fd(fd, port), true, false);
+        vhost_post_rx(port);
+      } else if (uring) {
+        // blocking reads are queued by the kernel instead of failing with
+        // EAGAIN
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        uring_post_reads(fd, port);
+        uring->submit();
+      } else if (not rx_paused) {
+        thread.add_read_fd(rx_fd(fd, port), true, false);
+      }
+    } break;
+    case TAP_IO_REM: {
+      auto it = sw_cbs.find(fd);
+      if (uring && it != sw_cbs.end()) {
+        uring->cancel(fd, it->second.serial);
+        uring->submit();
+      } else if (it != sw_cbs.end() &&
+                 (it->second.ring || it->second.vhost)) {
+        int poll_fd = rx_fd(fd, it->second);
+        thread.drop_fd(poll_fd, false);
+        rx_fds.erase(poll_fd);
+      } else {
+        thread.drop_fd(fd, false);
+      }
+      rx_active.erase(std::remove(rx_active.begin(), rx_active.end(), fd),
+                      rx_active.end());
       sw_cbs.erase(fd);
-      break;
+    } break;
+    case TAP_IO_MTU: {
+      auto it = sw_cbs.find(fd);
+      if (it != sw_cbs.end()) {
+        // allow for a single 802.1q tag
+        it->second.frame_size = std::get<4>(ev) + ETH_HLEN + 4;
+        VLOG(1) << __FUNCTION__ << ": fd=" << fd
+                << " frame_size=" << it->second.frame_size;
+      }
+    } break;
     default:
       break;
     }
@@ -153,6 +937,40 @@ void tap_io::handle_events() {
   events.clear();
 }
 
+static tap_config check_config(tap_config cfg) {
+  if (cfg.vhost && (cfg.io_uring || cfg.tpacket || cfg.vnet_hdr)) {
+    LOG(WARNING) << __FUNCTION__ << ": vhost replaces io_uring, tpacket and "
+                                    "vnet_hdr, disabling them";
+    cfg.io_uring = false;
+    cfg.tpacket = false;
+    cfg.vnet_hdr = false;
+  }
+  if (cfg.tpacket && (cfg.io_uring || cfg.vnet_hdr)) {
+    // frames are received unsegmented and from the ring only
+    LOG(WARNING) << __FUNCTION__ << ": io_uring and vnet_hdr are not "
+                                    "supported with tpacket, disabling them";
+    cfg.io_uring = false;
+    cfg.vnet_hdr = false;
+  }
+  return cfg;
+}
+
+tap_manager::tap_manager(const tap_config &cfg) : cfg(check_config(cfg)) {
+  unsigned int n = std::max(std::max(cfg.n_threads, cfg.n_queues), 1u);
+  for (unsigned int i = 0; i < n; i++) {
+    io.emplace_back(new tap_io(this->cfg));
+  }
+  LOG(INFO) << __FUNCTION__ << ": using " << n << " tap_io threads";
+}
+
+size_t tap_manager::io_index(uint32_t port_id, unsigned int queue) const {
+  // stable across restarts and independent of the order ports show up in,
+  // the queues of a port go to consecutive threads
+  uint32_t h = port_id * 0x9e3779b1u;
+  h ^= h >> 16;
+  return (h + queue) % io.size();
+}
+
 tap_manager::~tap_manager() { destroy_tapdevs(); }
 
 int tap_manager::create_tapdev(uint32_t port_id, const std::string &port_name,
@@ -163,12 +981,35 @@ int tap_manager::create_tapdev(uint32_t port_id, const std::string &port_name,
     ctapdev *dev;
     try {
       // XXX create mapping of port_ids?
-      dev = new ctapdev(port_name);
-      devs.insert(std::make_pair(port_id, dev));
+      // GSO frames do not fit the buffers posted to io_uring, so only the
+      // checksum is offloaded there
+      unsigned int offload = 0;
+      if (cfg.vnet_hdr) {
+        offload = TUN_F_CSUM;
+        if (not cfg.io_uring)
+          offload |= TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+      }
+      dev = new ctapdev(port_name, std::max(cfg.n_queues, 1u), cfg.vnet_hdr,
+                        offload);
+      {
+        std::lock_guard<std::mutex> lock(devs_mutex);
+        devs.insert(std::make_pair(port_id, dev));
+      }
       dev->tap_open();
-      int fd = dev->get_fd();
 
-      io.register_tap(fd, port_id, cb);
+      // falls back to reading from the tap fds if the ring cannot be set up
+      std::unique_ptr<tap_tpacket> ring;
+      if (cfg.tpacket) {
+        ring = tap_tpacket::create(port_name, dev->get_fd());
+      }
+
+      // the ring receives the frames of all queues
+      const std::vector<int> &fds = dev->get_fds();
+      for (size_t i = 0; i < fds.size(); i++) {
+        io_for(port_id, i).register_tap(fds[i], port_id, cb,
+                                        i == 0 ? std::move(ring) : nullptr);
+      }
+      publish_tap(port_id, dev->get_fd());
 
     } catch (std::exception &e) {
       LOG(ERROR) << __FUNCTION__ << ": failed to create tapdev " << port_name;
@@ -191,34 +1032,153 @@ int tap_manager::destroy_tapdev(uint32_t port_id,
   }
 
   auto dev = it->second;
-  int fd = dev->get_fd();
-  devs.erase(it);
+  std::vector<int> fds = dev->get_fds();
+  publish_tap(port_id, -1);
+  {
+    std::lock_guard<std::mutex> lock(devs_mutex);
+    devs.erase(it);
+  }
   delete dev;
 
   // XXX check if previous to delete
-  io.unregister_tap(fd, port_id);
+  for (size_t i = 0; i < fds.size(); i++) {
+    io_for(port_id, i).unregister_tap(fds[i], port_id);
+  }
+
+  return 0;
+}
+
+int tap_manager::change_port_mtu(uint32_t port_id, unsigned int mtu) {
+  std::lock_guard<std::mutex> lock(devs_mutex);
+  auto it = devs.find(port_id);
+  if (it == devs.end()) {
+    VLOG(1) << __FUNCTION__ << ": no tapdev for port_id=" << port_id;
+    return -ENODEV;
+  }
 
+  const std::vector<int> &fds = it->second->get_fds();
+  for (size_t i = 0; i < fds.size(); i++) {
+    io_for(port_id, i).set_mtu(fds[i], mtu);
+  }
   return 0;
 }
 
 void tap_manager::destroy_tapdevs() {
   std::map<uint32_t, ctapdev *> ddevs;
-  ddevs.swap(devs);
+  {
+    std::lock_guard<std::mutex> lock(devs_mutex);
+    std::atomic_store(&taps, std::shared_ptr<const port_index<tap_ref>>());
+    ddevs.swap(devs);
+  }
   for (auto &dev : ddevs) {
     delete dev.second;
   }
 }
 
-int tap_manager::enqueue(uint32_t port_id, rofl::cpacket *pkt) {
-  try {
-    int fd = devs.at(port_id)->get_fd();
-    io.enqueue(fd, pkt);
-  } catch (std::exception &e) {
-    LOG(ERROR) << __FUNCTION__ << ": failed to enqueue packet " << pkt
+int tap_manager::change_port_status(uint32_t port_id, bool up) {
+  std::lock_guard<std::mutex> lock(devs_mutex);
+  auto it = devs.find(port_id);
+  if (it == devs.end()) {
+    VLOG(1) << __FUNCTION__ << ": no tapdev for port_id=" << port_id;
+    return -ENODEV;
+  }
+
+  io_for(port_id).set_link_state(it->second->get_fd(), up);
+  return 0;
+}
+
+int tap_manager::get_tx_stats(uint32_t port_id, tap_io::tx_stats &stats) {
+  std::lock_guard<std::mutex> lock(devs_mutex);
+  auto it = devs.find(port_id);
+  if (it == devs.end() ||
+      not io_for(port_id).get_tx_stats(it->second->get_fd(), stats)) {
+    return -ENODEV;
+  }
+  return 0;
+}
+
+void tap_manager::get_tx_stats(std::map<uint32_t, tap_io::tx_stats> &stats) {
+  std::lock_guard<std::mutex> lock(devs_mutex);
+  for (auto &dev : devs) {
+    tap_io::tx_stats s;
+    if (io_for(dev.first).get_tx_stats(dev.second->get_fd(), s))
+      stats[dev.first] = s;
+  }
+}
+
+void tap_manager::get_rx_stats(tap_io::rx_stats &stats) {
+  stats = tap_io::rx_stats();
+  for (auto &t : io) {
+    tap_io::rx_stats s;
+    t->get_rx_stats(s);
+    for (unsigned int c = 0; c < n_pkt_classes; c++) {
+      stats.classes[c].delayed += s.classes[c].delayed;
+      stats.classes[c].dropped += s.classes[c].dropped;
+    }
+  }
+}
+
+void tap_manager::publish_tap(uint32_t port_id, int fd) {
+  std::lock_guard<std::mutex> lock(devs_mutex);
+  std::shared_ptr<const port_index<tap_ref>> cur = std::atomic_load(&taps);
+
+  // copied, other threads may still use the current index
+  std::shared_ptr<port_index<tap_ref>> idx =
+      cur ? std::make_shared<port_index<tap_ref>>(*cur)
+          : std::make_shared<port_index<tap_ref>>();
+  if (fd < 0) {
+    idx->erase(port_id);
+  } else {
+    tap_ref &ref = idx->set(port_id);
+    ref.fd = fd;
+    ref.io = &io_for(port_id);
+  }
+  std::atomic_store(&taps, std::shared_ptr<const port_index<tap_ref>>(idx));
+}
+
+int tap_manager::enqueue(uint32_t port_id, const uint8_t *frame, size_t len) {
+  std::shared_ptr<const port_index<tap_ref>> idx = std::atomic_load(&taps);
+  const tap_ref *tap = idx ? idx->find(port_id) : nullptr;
+  if (tap == nullptr) {
+    LOG(ERROR) << __FUNCTION__ << ": failed to enqueue frame to port_id="
+               << port_id;
+    return -ENODEV;
+  }
+  return tap->io->enqueue(tap->fd, frame, len);
+}
+
+int tap_manager::enqueue(uint32_t port_id, packet_ptr pkt) {
+  std::shared_ptr<const port_index<tap_ref>> idx = std::atomic_load(&taps);
+  const tap_ref *tap = idx ? idx->find(port_id) : nullptr;
+  if (tap == nullptr) {
+    LOG(ERROR) << __FUNCTION__ << ": failed to enqueue packet " << pkt.get()
                << " to port_id=" << port_id;
-    cpacketpool::get_instance().release_pkt(pkt);
+    return -ENODEV;
   }
+  tap->io->enqueue(tap->fd, std::move(pkt));
   return 0;
 }
 
+std::ostream &operator<<(std::ostream &os, const tap_io::tx_stats &s) {
+  os << "queued=" << s.queued << " dropped_full=" << s.dropped_full
+     << " dropped_ring=" << s.dropped_ring
+     << " dropped_link_down=" << s.dropped_link_down
+     << " dropped_error=" << s.dropped_error;
+  for (unsigned int c = 0; c < n_pkt_classes; c++) {
+    const char *name = pkt_class_name((enum pkt_class)c);
+    os << " " << name << "_delayed=" << s.classes[c].delayed << " " << name
+       << "_dropped=" << s.classes[c].dropped;
+  }
+  return os;
+}
+
+std::ostream &operator<<(std::ostream &os, const tap_io::rx_stats &s) {
+  for (unsigned int c = 0; c < n_pkt_classes; c++) {
+    const char *name = pkt_class_name((enum pkt_class)c);
+    os << (c ? " " : "") << name << "_delayed=" << s.classes[c].delayed << " "
+       << name << "_dropped=" << s.classes[c].dropped;
+  }
+  return os;
+}
+
 } // namespace rofcore
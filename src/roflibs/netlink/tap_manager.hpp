@@ -4,16 +4,25 @@
 
 #pragma once
 
+#include <atomic>
 #include <deque>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <ostream>
 
-#include <rofl/common/cpacket.h>
-
+#include "roflibs/netlink/cpacketpool.hpp"
 #include "roflibs/netlink/ctapdev.hpp"
+#include "roflibs/netlink/packet.hpp"
+#include "roflibs/netlink/pkt_class.hpp"
+#include "roflibs/netlink/port_index.hpp"
 #include "roflibs/netlink/sai.hpp"
+#include "roflibs/netlink/spsc_ring.hpp"
+#include "roflibs/netlink/tap_tpacket.hpp"
+#include "roflibs/netlink/tap_uring.hpp"
+#include "roflibs/netlink/tap_vhost.hpp"
 
 namespace rofcore {
 
@@ -22,53 +31,239 @@ class tap_manager;
 
 class switch_callback {
 public:
-  virtual int enqueue_to_switch(uint32_t port_id, rofl::cpacket *) = 0;
+  virtual int enqueue_to_switch(uint32_t port_id, packet_ptr pkt) = 0;
+  virtual int flood_to_switch(const std::vector<uint32_t> &port_ids,
+                              packet_ptr pkt) = 0;
+};
+
+struct tap_config {
+  tap_config()
+      : tx_queue_len(256), tx_drop_oldest(false), n_queues(1), n_threads(1),
+        io_uring(false), vnet_hdr(false), tpacket(false), vhost(false) {}
+
+  unsigned int tx_queue_len; // max packets queued per tap
+  bool tx_drop_oldest; // on overflow drop the oldest instead of the new packet
+  unsigned int n_queues;  // queues per tap
+  unsigned int n_threads; // tap_io threads, at least one per queue
+  bool io_uring; // use io_uring if available instead of read()/write()
+  bool vnet_hdr; // checksum and GSO offload from the host, see gso.hpp
+  bool tpacket;  // receive from the taps through a ring, see tap_tpacket
+  bool vhost;    // drive the taps through vhost-net, see tap_vhost
 };
 
-class tap_io : public rofl::cthread_env {
+class tap_io : public rofl::cthread_env, public packet_waiter {
   enum tap_io_event {
     TAP_IO_ADD,
     TAP_IO_REM,
+    TAP_IO_MTU,
+  };
+
+  struct tap_port {
+    uint32_t port_id;
+    switch_callback *cb;
+    size_t frame_size; // largest frame read from the tap
+    ssize_t deficit;   // bytes the port may still read in this round
+    bool active;       // in rx_active, fd is not polled
+    bool in_turn;      // got its quantum, the turn was not finished yet
+    uint64_t serial;   // of the registration, see tx_queue
+    unsigned int n_reads; // reads posted to uring
+    std::unique_ptr<tap_tpacket> ring; // frames are read from instead of fd
+    std::unique_ptr<tap_vhost> vhost;  // moves frames instead of fd
+  };
+
+  // fd polled for frames of the tap fd
+  static int rx_fd(int fd, const tap_port &port) {
+    if (port.ring)
+      return port.ring->get_fd();
+    if (port.vhost)
+      return port.vhost->get_event_fd();
+    return fd;
+  }
+
+  // bytes credited to a port per round of rx()
+  static const ssize_t rx_quantum = 16 * 1522;
+  // max frames read per call of rx() over all ports
+  static const unsigned int rx_budget = 256;
+
+  static const unsigned int uring_entries = 1024;
+  // reads posted per port, every port gets the same share of the ring
+  static const unsigned int uring_rx_depth = 8;
+
+  // packets handed over by a single producer thread until tx() runs
+  static const unsigned int tx_ring_len = 1024;
+
+public:
+  struct tx_stats {
+    size_t queued;
+    uint64_t dropped_full;      // queue overflow
+    uint64_t dropped_ring;      // producer ring overflow
+    uint64_t dropped_link_down; // port link or admin down
+    uint64_t dropped_error;     // write to the tap failed
+    class_stats classes[n_pkt_classes]; // delayed in and dropped from queue
+  };
+
+  // frames read from the taps
+  struct rx_stats {
+    class_stats classes[n_pkt_classes]; // dropped by enqueue_to_switch()
   };
 
+private:
+  struct tx_queue {
+    tx_queue(uint64_t serial)
+        : serial(serial), pending(0), n_inflight(0), blocked(false),
+          link_up(true), stats() {}
+
+    size_t n_queued() const {
+      size_t n = 0;
+      for (auto &q : pkts)
+        n += q.size();
+      return n;
+    }
+
+    // distinguishes completions of a closed tap from a new one reusing its fd
+    const uint64_t serial;
+    std::deque<packet_ptr> pkts[n_pkt_classes]; // served by strict priority
+    size_t pending;    // queued or being written by tx()
+    size_t n_inflight; // writes submitted to uring or vhost
+    bool blocked;      // waiting for the fd to become writable
+    bool link_up;
+    tx_stats stats;
+  };
+
+  struct tx_req {
+    int fd;
+    enum pkt_class cls;
+    packet_ptr pkt;
+  };
+  typedef spsc_ring<tx_req> tx_ring;
+
+  const tap_config cfg;
+  const uint64_t id; // unique over the lifetime of the process
   rofl::cthread thread;
-  std::deque<std::pair<int, rofl::cpacket *>> pout_queue;
-  std::mutex pout_queue_mutex;
 
-  std::deque<std::tuple<enum tap_io_event, int, uint32_t, switch_callback *>>
+  // nullptr unless io_uring is enabled and available
+  std::unique_ptr<tap_uring> uring;
+  std::atomic<uint64_t> next_serial;
+
+  // outgoing packets per tap fd, guarded by tx_mutex
+  std::map<int, tx_queue> tx_queues;
+  std::mutex tx_mutex;
+  // a ring per thread calling enqueue(), drained into tx_queues by tx().
+  // Registering and draining is guarded by tx_mutex, pushing is lock-free.
+  std::vector<std::unique_ptr<tx_ring>> tx_rings;
+  // set while a wakeup for tx() is outstanding
+  std::atomic<bool> tx_scheduled;
+
+  std::deque<std::tuple<enum tap_io_event, int, uint32_t, switch_callback *,
+                        unsigned int, std::unique_ptr<tap_tpacket>>>
       events;
   std::mutex events_mutex;
 
-  std::deque<std::pair<int, rofl::cpacket *>> pin_queue;
-  std::map<int, std::pair<uint32_t, switch_callback *>> sw_cbs;
+  std::deque<std::pair<int, packet_ptr>> pin_queue;
+  std::map<int, tap_port> sw_cbs;
+  // polled fd of a tpacket ring or vhost-net device to the tap fd
+  std::map<int, int> rx_fds;
+
+  // readable ports served by rx() in deficit round-robin order
+  std::deque<int> rx_active;
+  // set while a wakeup for rx() is outstanding, tap_io thread only
+  bool rx_scheduled;
+
+  // frames read in one round, handed to the switch by strict priority
+  struct rx_frame {
+    uint32_t port_id;
+    switch_callback *cb;
+    packet_ptr pkt;
+    std::vector<uint32_t> flood_ports; // identical copies read from these
+  };
+  std::deque<rx_frame> rx_pending[n_pkt_classes];
+  std::atomic<uint64_t> rx_delayed[n_pkt_classes];
+  std::atomic<uint64_t> rx_dropped[n_pkt_classes];
+
+  // reading from the taps is suspended while the packet pool is exhausted,
+  // rx_paused is only accessed on the tap_io thread
+  bool rx_paused;
+  std::atomic<bool> rx_resume;
+
+  // receives the part of a GSO frame exceeding the buffer of a regular frame
+  std::vector<uint8_t> rx_spill;
 
 public:
-  tap_io() : thread(this) { thread.start("tap_io"); };
+  tap_io(const tap_config &cfg);
   virtual ~tap_io();
 
   // port_id should be removed at some point and be rather data
-  void register_tap(int fd, uint32_t port_id, switch_callback &cb);
+  void register_tap(int fd, uint32_t port_id, switch_callback &cb,
+                    std::unique_ptr<tap_tpacket> ring = nullptr);
   void unregister_tap(int fd, uint32_t port_id);
-  void enqueue(int fd, rofl::cpacket *pkt);
+  void set_mtu(int fd, unsigned int mtu);
+
+  /**
+   * @brief set the link state of the port behind fd
+   *
+   * Packets to ports with link down are dropped instead of queued.
+   */
+  void set_link_state(int fd, bool up);
+
+  bool get_tx_stats(int fd, tx_stats &stats);
+
+  void get_rx_stats(rx_stats &stats);
+
+  void enqueue(int fd, packet_ptr pkt);
+
+  /**
+   * @brief write a frame owned by the caller to fd
+   *
+   * In case no packets of the calling thread are pending for fd the frame is
+   * written right away, otherwise it is copied into a pool packet and queued
+   * to keep the order. With vhost or io_uring the frame is always copied and
+   * queued.
+   */
+  int enqueue(int fd, const uint8_t *frame, size_t len);
+
+  // packet_waiter
+  void pkts_available() override;
 
 protected:
   void handle_read_event(rofl::cthread &thread, int fd);
   void handle_write_event(rofl::cthread &thread, int fd);
   void handle_wakeup(rofl::cthread &thread) {
     handle_events();
+    if (rx_resume.exchange(false))
+      resume_rx();
+    rx_scheduled = false;
+    if (not rx_active.empty())
+      rx();
     tx();
   }
   void handle_timeout(rofl::cthread &thread, uint32_t timer_id) {}
 
 private:
+  void rx();
+  void rx_queue(tap_port &port, packet_ptr pkt);
+  void rx_flush();
+  void rx_coalesce(std::deque<rx_frame> &frames);
+  ssize_t read_vnet(int fd, packet_ptr &pkt);
+  static bool pull_vnet_hdr(packet &pkt);
   void tx();
+  tx_ring &producer_ring();
+  void drain_tx_rings(std::deque<packet_ptr> &dropped);
+  size_t write_batch(int fd, std::deque<packet_ptr> &pkts, int &err);
   void handle_events();
+  void pause_rx(size_t frame_size);
+  void resume_rx();
+
+  void uring_post_reads(int fd, tap_port &port);
+  void uring_complete();
+
+  void vhost_post_rx(tap_port &port);
+  void vhost_complete(int fd, tap_port &port);
 };
 
 class tap_manager final {
 
 public:
-  tap_manager() {}
+  tap_manager(const tap_config &cfg = tap_config());
   ~tap_manager();
 
   int create_tapdev(uint32_t port_id, const std::string &port_name,
@@ -76,17 +271,61 @@ public:
 
   int destroy_tapdev(uint32_t port_id, const std::string &port_name);
 
+  int change_port_mtu(uint32_t port_id, unsigned int mtu);
+
+  int change_port_status(uint32_t port_id, bool up);
+
+  int get_tx_stats(uint32_t port_id, tap_io::tx_stats &stats);
+
+  /**
+   * @brief tx counters of all taps by port_id
+   */
+  void get_tx_stats(std::map<uint32_t, tap_io::tx_stats> &stats);
+
+  /**
+   * @brief frames read from all taps
+   */
+  void get_rx_stats(tap_io::rx_stats &stats);
+
   void destroy_tapdevs();
 
-  int enqueue(uint32_t port_id, rofl::cpacket *pkt);
+  int enqueue(uint32_t port_id, packet_ptr pkt);
+
+  int enqueue(uint32_t port_id, const uint8_t *frame, size_t len);
 
 private:
   tap_manager(const tap_manager &other) = delete; // non construction-copyable
   tap_manager &operator=(const tap_manager &) = delete; // non copyable
 
+  // devs is modified on the OpenFlow thread only, other threads have to
+  // acquire devs_mutex
   std::map<uint32_t, ctapdev *> devs;
+  std::mutex devs_mutex;
+
+  // first queue of each tap for enqueue(), read without locks on any thread
+  // and replaced as a whole under devs_mutex by publish_tap()
+  struct tap_ref {
+    tap_ref() : fd(-1), io(nullptr) {}
+    int fd;
+    tap_io *io;
+  };
+  std::shared_ptr<const port_index<tap_ref>> taps;
+
+  void publish_tap(uint32_t port_id, int fd);
+
+  const tap_config cfg;
 
-  rofcore::tap_io io;
+  // taps are spread across the tap_io threads by port_id, see io_index().
+  // Frames to the host are written to the first queue of a tap.
+  std::vector<std::unique_ptr<tap_io>> io;
+
+  tap_io &io_for(uint32_t port_id, unsigned int queue = 0) {
+    return *io[io_index(port_id, queue)];
+  }
+  size_t io_index(uint32_t port_id, unsigned int queue) const;
 };
 
+std::ostream &operator<<(std::ostream &os, const tap_io::tx_stats &s);
+std::ostream &operator<<(std::ostream &os, const tap_io::rx_stats &s);
+
 } // namespace rofcore
@@ -0,0 +1,166 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <glog/logging.h>
+
+#include "roflibs/netlink/tap_tpacket.hpp"
+
+namespace rofcore {
+
+tap_tpacket::tap_tpacket(int fd, uint8_t *ring)
+    : fd(fd), ring(ring), cur_block(0), in_block(false), n_left(0),
+      next_frame(nullptr) {}
+
+tap_tpacket::~tap_tpacket() {
+  munmap(ring, (size_t)block_size * n_blocks);
+  close(fd);
+}
+
+std::unique_ptr<tap_tpacket> tap_tpacket::create(const std::string &devname,
+                                                 int tap_fd) {
+  unsigned int ifindex = if_nametoindex(devname.c_str());
+  if (ifindex == 0) {
+    LOG(ERROR) << __FUNCTION__ << ": no interface " << devname;
+    return nullptr;
+  }
+
+  // bound to no protocol, nothing is received before bind()
+  int fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG(ERROR) << __FUNCTION__ << ": socket failed: " << strerror(errno);
+    return nullptr;
+  }
+
+  // only frames sent by the host, not the ones written to the tap fd
+  struct sock_filter outgoing[] = {
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+               (uint32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, 0xffff),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog outgoing_prog = {sizeof(outgoing) / sizeof(outgoing[0]),
+                                     outgoing};
+
+  int version = TPACKET_V3;
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = block_size;
+  req.tp_block_nr = n_blocks;
+  req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+  req.tp_frame_nr = (block_size / req.tp_frame_size) * n_blocks;
+  req.tp_retire_blk_tov = block_timeout_ms;
+
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) <
+          0 ||
+      setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &outgoing_prog,
+                 sizeof(outgoing_prog)) < 0 ||
+      setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    LOG(ERROR) << __FUNCTION__ << ": failed to set up ring on " << devname
+               << ": " << strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+
+  void *ring = mmap(nullptr, (size_t)block_size * n_blocks,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+  if (ring == MAP_FAILED) {
+    // MAP_LOCKED is subject to RLIMIT_MEMLOCK
+    ring = mmap(nullptr, (size_t)block_size * n_blocks, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+  }
+  if (ring == MAP_FAILED) {
+    LOG(ERROR) << __FUNCTION__ << ": mmap failed: " << strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+
+  struct sockaddr_ll sll;
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    LOG(ERROR) << __FUNCTION__ << ": bind to " << devname
+               << " failed: " << strerror(errno);
+    munmap(ring, (size_t)block_size * n_blocks);
+    close(fd);
+    return nullptr;
+  }
+
+  // the frames are dropped by the tap before they are queued for the tap fd
+  struct sock_filter drop[] = {
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog drop_prog = {1, drop};
+  if (ioctl(tap_fd, TUNATTACHFILTER, &drop_prog) < 0) {
+    // without the filter every frame would be received twice
+    LOG(ERROR) << __FUNCTION__ << ": TUNATTACHFILTER failed on " << devname
+               << ": " << strerror(errno);
+    munmap(ring, (size_t)block_size * n_blocks);
+    close(fd);
+    return nullptr;
+  }
+
+  LOG(INFO) << __FUNCTION__ << ": attached ring to " << devname
+            << " fd=" << fd << " size=" << (size_t)block_size * n_blocks;
+
+  return std::unique_ptr<tap_tpacket>(
+      new tap_tpacket(fd, static_cast<uint8_t *>(ring)));
+}
+
+void tap_tpacket::release_block() {
+  struct tpacket_block_desc *desc =
+      (struct tpacket_block_desc *)(ring + (size_t)cur_block * block_size);
+
+  __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                   __ATOMIC_RELEASE);
+  cur_block = (cur_block + 1) % n_blocks;
+  in_block = false;
+}
+
+ssize_t tap_tpacket::read(uint8_t *buf, size_t len) {
+  while (n_left == 0) {
+    if (in_block) {
+      release_block();
+    }
+
+    struct tpacket_block_desc *desc =
+        (struct tpacket_block_desc *)(ring + (size_t)cur_block * block_size);
+    if (not(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+            TP_STATUS_USER)) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    in_block = true;
+    n_left = desc->hdr.bh1.num_pkts;
+    next_frame = (uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt;
+  }
+
+  struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)next_frame;
+  size_t n_bytes = std::min((size_t)hdr->tp_snaplen, len);
+  memcpy(buf, next_frame + hdr->tp_mac, n_bytes);
+
+  next_frame += hdr->tp_next_offset;
+  n_left--;
+  return n_bytes;
+}
+
+} // namespace rofcore
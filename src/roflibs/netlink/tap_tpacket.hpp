@@ -0,0 +1,76 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace rofcore {
+
+/**
+ * @brief receive frames sent by the host to a tap from a TPACKET_V3 ring
+ *
+ * An AF_PACKET socket bound to the tap picks up the frames the host transmits
+ * (PACKET_OUTGOING) and the kernel fills them into shared memory blocks.
+ * Reading from the tap fd is not needed anymore, so a filter dropping every
+ * frame is attached to the tap.
+ *
+ * Frames towards the host are still written to the tap fd, a TX ring on the
+ * tap would send them to the tap fd instead of the host.
+ *
+ * get_fd() becomes readable once a block was handed over to user space. All
+ * methods have to be called on the thread polling get_fd().
+ */
+class tap_tpacket {
+public:
+  // 8 blocks of 256 KiB per tap
+  static const unsigned int block_size = 1 << 18;
+  static const unsigned int n_blocks = 8;
+  // max delay of a frame in a block not filled up
+  static const unsigned int block_timeout_ms = 1;
+
+  /**
+   * @brief attach a ring to the tap devname
+   *
+   * @param tap_fd fd of the tap, frames are no longer queued to it
+   * @return nullptr in case the ring could not be set up
+   */
+  static std::unique_ptr<tap_tpacket> create(const std::string &devname,
+                                             int tap_fd);
+
+  ~tap_tpacket();
+
+  int get_fd() const { return fd; }
+
+  /**
+   * @brief copy the next frame of the ring into buf
+   *
+   * Semantics follow read(2), frames exceeding len are truncated.
+   *
+   * @return length of the frame or -1 with errno set to EAGAIN if the ring is
+   * empty
+   */
+  ssize_t read(uint8_t *buf, size_t len);
+
+private:
+  tap_tpacket(int fd, uint8_t *ring);
+  tap_tpacket(const tap_tpacket &) = delete;
+  tap_tpacket &operator=(const tap_tpacket &) = delete;
+
+  void release_block();
+
+  int fd;
+  uint8_t *ring;
+
+  unsigned int cur_block; // block frames are read from
+  bool in_block;          // cur_block is owned by user space
+  unsigned int n_left;    // frames left in cur_block
+  uint8_t *next_frame;
+};
+
+} // namespace rofcore
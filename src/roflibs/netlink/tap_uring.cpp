@@ -0,0 +1,243 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "roflibs/netlink/cpacketpool.hpp"
+#include "roflibs/netlink/tap_uring.hpp"
+
+namespace rofcore {
+
+#ifdef HAVE_LIBURING
+
+// registering pins the pool regions and charges them to the locked memory
+// limit, so they are registered with a single ring at a time. Rings created
+// while it exists read and write without fixed buffers.
+static std::mutex buffers_mutex;
+static bool buffers_registered = false;
+
+class tap_uring_impl : public tap_uring {
+  struct request {
+    enum op_type op;
+    int fd;
+    uint64_t tag;
+    packet *pkt;
+    bool in_use;
+    request *next_free;
+  };
+
+  struct io_uring ring;
+  int efd;
+  bool fixed_buffers;
+
+  // user_data of the sqes, the deque keeps pointers stable while growing
+  std::deque<request> requests;
+  request *free_requests;
+
+  request *alloc_request(enum op_type op, int fd, uint64_t tag, packet *pkt) {
+    request *req = free_requests;
+    if (req) {
+      free_requests = req->next_free;
+    } else {
+      requests.emplace_back();
+      req = &requests.back();
+    }
+    *req = request{op, fd, tag, pkt, true, nullptr};
+    return req;
+  }
+
+  void free_request(request *req) {
+    req->in_use = false;
+    req->pkt = nullptr;
+    req->next_free = free_requests;
+    free_requests = req;
+  }
+
+  struct io_uring_sqe *get_sqe() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      // submission queue full, flush it
+      io_uring_submit(&ring);
+      sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+  }
+
+public:
+  tap_uring_impl() : efd(-1), fixed_buffers(false), free_requests(nullptr) {}
+
+  ~tap_uring_impl() override {
+    io_uring_queue_exit(&ring);
+    close(efd);
+    if (fixed_buffers) {
+      std::lock_guard<std::mutex> guard(buffers_mutex);
+      cpacketpool::get_instance().unpin_regions();
+      buffers_registered = false;
+    }
+
+    // the kernel cancels pending requests asynchronously, so the packets of
+    // requests still in flight are not returned to the pool
+    for (auto &req : requests) {
+      if (req.in_use && req.pkt) {
+        VLOG(1) << __FUNCTION__ << ": leaking in-flight pkt=" << req.pkt;
+      }
+    }
+  }
+
+  int init(unsigned int entries) {
+    int rv = io_uring_queue_init(entries, &ring, 0);
+    if (rv < 0) {
+      return rv;
+    }
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0 || (rv = io_uring_register_eventfd(&ring, efd)) < 0) {
+      rv = efd < 0 ? -errno : rv;
+      io_uring_queue_exit(&ring);
+      if (efd >= 0)
+        close(efd);
+      return rv;
+    }
+
+    std::lock_guard<std::mutex> guard(buffers_mutex);
+    if (buffers_registered) {
+      return 0;
+    }
+
+    // registering faults in and pins the regions for the maximum pool size,
+    // the pool does not return idle slabs to the system anymore
+    cpacketpool &pool = cpacketpool::get_instance();
+    std::vector<struct iovec> regions = pool.get_regions();
+    pool.pin_regions();
+    rv = io_uring_register_buffers(&ring, regions.data(), regions.size());
+    if (rv < 0) {
+      LOG(WARNING) << __FUNCTION__
+                   << ": failed to register packet buffers: " << strerror(-rv);
+      pool.unpin_regions();
+    } else {
+      fixed_buffers = buffers_registered = true;
+    }
+    return 0;
+  }
+
+  int get_event_fd() const override { return efd; }
+
+  bool read(int fd, uint64_t tag, packet_ptr pkt) override {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) {
+      return false;
+    }
+
+    if (fixed_buffers) {
+      io_uring_prep_read_fixed(sqe, fd, pkt->soframe(), pkt->capacity(), 0,
+                               cpacketpool::region_of(pkt.get()));
+    } else {
+      io_uring_prep_read(sqe, fd, pkt->soframe(), pkt->capacity(), 0);
+    }
+    io_uring_sqe_set_data(
+        sqe, alloc_request(TAP_URING_READ, fd, tag, pkt.release()));
+    return true;
+  }
+
+  size_t write(int fd, uint64_t tag, std::deque<packet_ptr> &pkts) override {
+    // a chain must not be split by a submit, only queue what fits
+    size_t n = std::min<size_t>(pkts.size(), io_uring_sq_space_left(&ring));
+
+    for (size_t i = 0; i < n; i++) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+      packet_ptr &pkt = pkts.front();
+
+      if (fixed_buffers) {
+        io_uring_prep_write_fixed(sqe, fd, pkt->soframe(), pkt->length(), 0,
+                                  cpacketpool::region_of(pkt.get()));
+      } else {
+        io_uring_prep_write(sqe, fd, pkt->soframe(), pkt->length(), 0);
+      }
+      if (i + 1 < n) {
+        // keep the order of frames
+        sqe->flags |= IOSQE_IO_LINK;
+      }
+      io_uring_sqe_set_data(
+          sqe, alloc_request(TAP_URING_WRITE, fd, tag, pkt.release()));
+      pkts.pop_front();
+    }
+    return n;
+  }
+
+  void cancel(int fd, uint64_t tag) override {
+    for (auto &req : requests) {
+      if (not req.in_use || req.fd != fd || req.tag != tag)
+        continue;
+
+      struct io_uring_sqe *sqe = get_sqe();
+      if (sqe == nullptr) {
+        LOG(ERROR) << __FUNCTION__ << ": no sqe to cancel request on fd=" << fd;
+        return;
+      }
+      io_uring_prep_cancel(sqe, &req, 0);
+      io_uring_sqe_set_data(sqe, nullptr);
+    }
+  }
+
+  void submit() override {
+    int rv = io_uring_submit(&ring);
+    if (rv < 0) {
+      LOG(ERROR) << __FUNCTION__ << ": io_uring_submit failed: "
+                 << strerror(-rv);
+    }
+  }
+
+  void reap(std::deque<completion> &completions) override {
+    uint64_t cnt;
+    if (::read(efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+      LOG(ERROR) << __FUNCTION__ << ": read from eventfd failed: "
+                 << strerror(errno);
+    }
+
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+      request *req = (request *)io_uring_cqe_get_data(cqe);
+      // cancellations carry no request
+      if (req) {
+        completions.emplace_back(completion{req->op, req->fd, req->tag,
+                                            cqe->res, packet_ptr(req->pkt)});
+        free_request(req);
+      }
+      io_uring_cqe_seen(&ring, cqe);
+    }
+  }
+};
+
+std::unique_ptr<tap_uring> tap_uring::create(unsigned int entries) {
+  std::unique_ptr<tap_uring_impl> uring(new tap_uring_impl());
+  int rv = uring->init(entries);
+  if (rv < 0) {
+    LOG(WARNING) << __FUNCTION__ << ": io_uring unavailable: " << strerror(-rv);
+    return nullptr;
+  }
+  return std::move(uring);
+}
+
+#else
+
+std::unique_ptr<tap_uring> tap_uring::create(unsigned int entries) {
+  LOG(WARNING) << __FUNCTION__ << ": built without io_uring support";
+  return nullptr;
+}
+
+#endif // HAVE_LIBURING
+
+} // namespace rofcore
@@ -0,0 +1,77 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <deque>
+#include <memory>
+
+#include "roflibs/netlink/packet.hpp"
+
+namespace rofcore {
+
+/**
+ * @brief asynchronous tap I/O based on io_uring
+ *
+ * Reads are posted into pool packets ahead of time, the writes of a batch
+ * are linked and complete in order. Completions are signalled through
+ * get_event_fd(), which is polled by the owning thread. All methods have to
+ * be called on that thread.
+ */
+class tap_uring {
+public:
+  enum op_type {
+    TAP_URING_READ,
+    TAP_URING_WRITE,
+  };
+
+  struct completion {
+    enum op_type op;
+    int fd;
+    uint64_t tag; // as passed to read() or write()
+    int res;      // bytes transferred or -errno
+    packet_ptr pkt;
+  };
+
+  /**
+   * @brief create an io_uring instance
+   *
+   * @return nullptr in case io_uring is not supported by the build or by the
+   * running kernel
+   */
+  static std::unique_ptr<tap_uring> create(unsigned int entries);
+
+  virtual ~tap_uring() {}
+
+  virtual int get_event_fd() const = 0;
+
+  /**
+   * @brief post a read from fd into pkt
+   *
+   * @return false if the read could not be queued, pkt is dropped
+   */
+  virtual bool read(int fd, uint64_t tag, packet_ptr pkt) = 0;
+
+  /**
+   * @brief queue linked writes of pkts to fd
+   *
+   * @return number of packets queued, these are removed from the front of
+   * pkts
+   */
+  virtual size_t write(int fd, uint64_t tag, std::deque<packet_ptr> &pkts) = 0;
+
+  /**
+   * @brief cancel all pending operations on fd queued with tag
+   */
+  virtual void cancel(int fd, uint64_t tag) = 0;
+
+  virtual void submit() = 0;
+
+  /**
+   * @brief append all available completions
+   */
+  virtual void reap(std::deque<completion> &completions) = 0;
+};
+
+} // namespace rofcore
@@ -0,0 +1,276 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// the legacy helpers of virtio_ring.h do not compile as C++
+#define VIRTIO_RING_NO_LEGACY
+#include <linux/vhost.h>
+#include <linux/virtio_ring.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <glog/logging.h>
+
+#include "roflibs/netlink/cpacketpool.hpp"
+#include "roflibs/netlink/tap_vhost.hpp"
+
+namespace rofcore {
+
+tap_vhost::tap_vhost() : dev_fd(-1), call_fd(-1), attached(false) {
+  for (auto &vq : vqs) {
+    vq.mem = nullptr;
+    vq.mem_size = 0;
+    vq.avail_idx = 0;
+    vq.last_used = 0;
+    vq.kick_fd = -1;
+  }
+}
+
+tap_vhost::~tap_vhost() {
+  if (attached) {
+    for (unsigned int i = 0; i < 2; i++) {
+      struct vhost_vring_file backend = {i, -1};
+      ioctl(dev_fd, VHOST_NET_SET_BACKEND, &backend);
+    }
+  }
+
+  // the worker is stopped once the device is closed, afterwards the posted
+  // packets can be returned to the pool
+  if (dev_fd >= 0)
+    close(dev_fd);
+  if (call_fd >= 0)
+    close(call_fd);
+  for (auto &vq : vqs) {
+    if (vq.kick_fd >= 0)
+      close(vq.kick_fd);
+    if (vq.mem)
+      munmap(vq.mem, vq.mem_size);
+  }
+}
+
+std::unique_ptr<tap_vhost> tap_vhost::create(int tap_fd) {
+  std::unique_ptr<tap_vhost> vhost(new tap_vhost());
+  int rv = vhost->init(tap_fd);
+  if (rv < 0) {
+    LOG(WARNING) << __FUNCTION__ << ": vhost-net unavailable for fd=" << tap_fd
+                 << ": " << strerror(-rv);
+    return nullptr;
+  }
+  return vhost;
+}
+
+int tap_vhost::init(int tap_fd) {
+  if ((dev_fd = open("/dev/vhost-net", O_RDWR | O_CLOEXEC)) < 0) {
+    return -errno;
+  }
+
+  if (ioctl(dev_fd, VHOST_SET_OWNER) < 0) {
+    return -errno;
+  }
+
+  // vhost adds and strips the virtio_net_hdr, the tap stays without
+  // IFF_VNET_HDR
+  uint64_t features;
+  if (ioctl(dev_fd, VHOST_GET_FEATURES, &features) < 0) {
+    return -errno;
+  }
+  if (not(features & (1ULL << VHOST_NET_F_VIRTIO_NET_HDR))) {
+    return -ENOTSUP;
+  }
+  features = 1ULL << VHOST_NET_F_VIRTIO_NET_HDR;
+  if (ioctl(dev_fd, VHOST_SET_FEATURES, &features) < 0) {
+    return -errno;
+  }
+
+  // guest physical addresses are our virtual addresses
+  std::vector<struct iovec> regions = cpacketpool::get_instance().get_regions();
+  std::vector<uint8_t> table(sizeof(struct vhost_memory) +
+                             regions.size() *
+                                 sizeof(struct vhost_memory_region));
+  struct vhost_memory *mem = (struct vhost_memory *)table.data();
+  mem->nregions = regions.size();
+  for (size_t i = 0; i < regions.size(); i++) {
+    mem->regions[i].guest_phys_addr = (uintptr_t)regions[i].iov_base;
+    mem->regions[i].userspace_addr = (uintptr_t)regions[i].iov_base;
+    mem->regions[i].memory_size = regions[i].iov_len;
+  }
+  if (ioctl(dev_fd, VHOST_SET_MEM_TABLE, mem) < 0) {
+    return -errno;
+  }
+
+  // a single event for used buffers of both queues
+  if ((call_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    return -errno;
+  }
+
+  for (unsigned int i = 0; i < 2; i++) {
+    int rv = init_vq(i, vqs[i]);
+    if (rv < 0)
+      return rv;
+  }
+
+  for (unsigned int i = 0; i < 2; i++) {
+    struct vhost_vring_file backend = {i, tap_fd};
+    if (ioctl(dev_fd, VHOST_NET_SET_BACKEND, &backend) < 0) {
+      return -errno;
+    }
+    attached = true;
+  }
+
+  LOG(INFO) << __FUNCTION__ << ": attached vhost-net to fd=" << tap_fd
+            << " ring_size=" << ring_size;
+  return 0;
+}
+
+int tap_vhost::init_vq(unsigned int index, virtqueue &vq) {
+  size_t desc_size = sizeof(struct vring_desc) * ring_size;
+  size_t avail_size = sizeof(uint16_t) * (3 + ring_size);
+  size_t used_offset = (desc_size + avail_size + 63) & ~(size_t)63;
+  size_t used_size =
+      sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * ring_size;
+
+  vq.mem_size = used_offset + used_size;
+  vq.mem = mmap(nullptr, vq.mem_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (vq.mem == MAP_FAILED) {
+    vq.mem = nullptr;
+    return -errno;
+  }
+  vq.desc = (struct vring_desc *)vq.mem;
+  vq.avail = (struct vring_avail *)((uint8_t *)vq.mem + desc_size);
+  vq.used = (struct vring_used *)((uint8_t *)vq.mem + used_offset);
+
+  vq.bufs.resize(ring_size);
+  for (unsigned int id = ring_size; id > 0; id--) {
+    vq.free_ids.push_back(id - 1);
+  }
+
+  if ((vq.kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    return -errno;
+  }
+
+  struct vhost_vring_state num = {index, ring_size};
+  struct vhost_vring_state base = {index, 0};
+  struct vhost_vring_addr addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.index = index;
+  addr.desc_user_addr = (uintptr_t)vq.desc;
+  addr.avail_user_addr = (uintptr_t)vq.avail;
+  addr.used_user_addr = (uintptr_t)vq.used;
+  struct vhost_vring_file kick = {index, vq.kick_fd};
+  struct vhost_vring_file call = {index, call_fd};
+
+  if (ioctl(dev_fd, VHOST_SET_VRING_NUM, &num) < 0 ||
+      ioctl(dev_fd, VHOST_SET_VRING_BASE, &base) < 0 ||
+      ioctl(dev_fd, VHOST_SET_VRING_ADDR, &addr) < 0 ||
+      ioctl(dev_fd, VHOST_SET_VRING_KICK, &kick) < 0 ||
+      ioctl(dev_fd, VHOST_SET_VRING_CALL, &call) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+void tap_vhost::ack_event() {
+  uint64_t n;
+  if (::read(call_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+    LOG(ERROR) << __FUNCTION__ << ": read failed: " << strerror(errno);
+  }
+}
+
+void tap_vhost::add_buf(virtqueue &vq, packet_ptr pkt, uint16_t flags) {
+  assert(not vq.free_ids.empty());
+  uint16_t id = vq.free_ids.back();
+  vq.free_ids.pop_back();
+
+  struct vring_desc &desc = vq.desc[id];
+  desc.addr = (uintptr_t)pkt->soframe();
+  desc.len = (flags & VRING_DESC_F_WRITE) ? pkt->capacity() : pkt->length();
+  desc.flags = flags;
+  desc.next = 0;
+
+  vq.avail->ring[vq.avail_idx % ring_size] = id;
+  vq.avail_idx++;
+  vq.bufs[id] = std::move(pkt);
+}
+
+void tap_vhost::kick(virtqueue &vq) {
+  __atomic_store_n(&vq.avail->idx, vq.avail_idx, __ATOMIC_RELEASE);
+
+  // pairs with the kernel re-enabling notifications before checking the
+  // available ring once more
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (__atomic_load_n(&vq.used->flags, __ATOMIC_RELAXED) &
+      VRING_USED_F_NO_NOTIFY) {
+    return;
+  }
+
+  uint64_t one = 1;
+  if (::write(vq.kick_fd, &one, sizeof(one)) < 0) {
+    LOG(ERROR) << __FUNCTION__ << ": write failed: " << strerror(errno);
+  }
+}
+
+template <typename F> size_t tap_vhost::reap(virtqueue &vq, F done) {
+  uint16_t used_idx = __atomic_load_n(&vq.used->idx, __ATOMIC_ACQUIRE);
+  size_t n = 0;
+
+  for (; vq.last_used != used_idx; vq.last_used++) {
+    struct vring_used_elem &elem = vq.used->ring[vq.last_used % ring_size];
+    if (elem.id >= ring_size || vq.bufs[elem.id] == nullptr) {
+      LOG(ERROR) << __FUNCTION__ << ": invalid descriptor id=" << elem.id;
+      continue;
+    }
+    done(std::move(vq.bufs[elem.id]), elem.len);
+    vq.free_ids.push_back(elem.id);
+    n++;
+  }
+  return n;
+}
+
+void tap_vhost::post_rx(packet_ptr pkt) {
+  add_buf(vqs[rx_vq], std::move(pkt), VRING_DESC_F_WRITE);
+}
+
+void tap_vhost::kick_rx() { kick(vqs[rx_vq]); }
+
+void tap_vhost::reap_rx(std::deque<packet_ptr> &pkts) {
+  reap(vqs[rx_vq], [&pkts](packet_ptr pkt, uint32_t len) {
+    if (len < sizeof(struct virtio_net_hdr)) {
+      return;
+    }
+    pkt->set_length(len);
+    pkt->pull(sizeof(struct virtio_net_hdr));
+    pkts.push_back(std::move(pkt));
+  });
+}
+
+size_t tap_vhost::write(std::deque<packet_ptr> &pkts) {
+  virtqueue &vq = vqs[tx_vq];
+  size_t n = 0;
+
+  while (not pkts.empty() && not vq.free_ids.empty()) {
+    packet_ptr pkt = std::move(pkts.front());
+    pkts.pop_front();
+    memset(pkt->push(sizeof(struct virtio_net_hdr)), 0,
+           sizeof(struct virtio_net_hdr));
+    add_buf(vq, std::move(pkt), 0);
+    n++;
+  }
+  if (n)
+    kick(vq);
+  return n;
+}
+
+size_t tap_vhost::reap_tx() {
+  return reap(vqs[tx_vq], [](packet_ptr pkt, uint32_t len) {});
+}
+
+} // namespace rofcore
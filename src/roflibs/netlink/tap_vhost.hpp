@@ -0,0 +1,119 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "roflibs/netlink/packet.hpp"
+
+struct vring_desc;
+struct vring_avail;
+struct vring_used;
+
+namespace rofcore {
+
+/**
+ * @brief tap I/O through the virtqueues of a vhost-net device
+ *
+ * The vhost-net worker of the kernel moves frames between the tap and pool
+ * packets posted to a RX and a TX virtqueue. The pool regions are mapped 1:1
+ * into the memory table of the device, so packets are referenced by their
+ * address. Every buffer starts with a struct virtio_net_hdr, which is
+ * stripped from received packets and pushed in front of written ones.
+ *
+ * Used buffers of both queues are signalled through get_event_fd(). All
+ * methods have to be called on the thread polling it.
+ */
+class tap_vhost {
+public:
+  // descriptors per virtqueue
+  static const unsigned int ring_size = 256;
+
+  /**
+   * @brief attach a vhost-net device to tap_fd
+   *
+   * @return nullptr in case vhost-net is not available
+   */
+  static std::unique_ptr<tap_vhost> create(int tap_fd);
+
+  ~tap_vhost();
+
+  int get_event_fd() const { return call_fd; }
+
+  /**
+   * @brief clear get_event_fd() before reaping
+   */
+  void ack_event();
+
+  /**
+   * @brief number of receive buffers that can still be posted
+   */
+  size_t rx_room() const { return vqs[rx_vq].free_ids.size(); }
+
+  /**
+   * @brief post pkt to receive a frame from the host, requires rx_room()
+   *
+   * Posted buffers are handed to the kernel by kick_rx().
+   */
+  void post_rx(packet_ptr pkt);
+
+  void kick_rx();
+
+  /**
+   * @brief append the received packets to pkts
+   */
+  void reap_rx(std::deque<packet_ptr> &pkts);
+
+  /**
+   * @brief queue pkts for writing to the host
+   *
+   * @return number of packets queued, these are removed from the front of
+   * pkts
+   */
+  size_t write(std::deque<packet_ptr> &pkts);
+
+  /**
+   * @brief release written packets
+   *
+   * @return number of packets written since the last call
+   */
+  size_t reap_tx();
+
+private:
+  enum { rx_vq = 0, tx_vq = 1 };
+
+  struct virtqueue {
+    void *mem;
+    size_t mem_size;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t avail_idx;
+    uint16_t last_used;
+    int kick_fd;
+    std::vector<packet_ptr> bufs; // posted packets by descriptor id
+    std::vector<uint16_t> free_ids;
+  };
+
+  tap_vhost();
+  tap_vhost(const tap_vhost &) = delete;
+  tap_vhost &operator=(const tap_vhost &) = delete;
+
+  int init(int tap_fd);
+  int init_vq(unsigned int index, virtqueue &vq);
+  void add_buf(virtqueue &vq, packet_ptr pkt, uint16_t flags);
+  void kick(virtqueue &vq);
+  template <typename F> size_t reap(virtqueue &vq, F done);
+
+  int dev_fd;
+  int call_fd;
+  bool attached;
+  virtqueue vqs[2];
+};
+
+} // namespace rofcore
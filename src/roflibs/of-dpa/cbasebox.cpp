@@ -4,12 +4,16 @@
 
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <linux/if_ether.h>
 #include <stdio.h>
 
 #include "cbasebox.hpp"
 
 #include "roflibs/netlink/cpacketpool.hpp"
+#include "roflibs/netlink/gso.hpp"
+#include "roflibs/netlink/pkt_class.hpp"
 #include "roflibs/of-dpa/ofdpa_datatypes.hpp"
 
 namespace basebox {
@@ -19,6 +23,68 @@ struct vlan_hdr {
   uint16_t vlan;     // ethernet type
 } __attribute__((packed));
 
+// 802.1Q tag inserted in front of the ethernet type
+static const size_t vlan_tag_len = 4;
+
+// log while handle_dpt_close() keeps waiting for packet-outs
+static const std::chrono::seconds dpt_close_timeout(1);
+
+// counts a thread as user of the datapath of the port table while in scope,
+// taken before loading the table
+class cbasebox::dpt_user {
+public:
+  dpt_user(cbasebox &box) : box(box) { box.n_dpt_users.fetch_add(1); }
+  ~dpt_user() {
+    // pairs with handle_dpt_close() setting dpt_closing before checking
+    // n_dpt_users, one of both sees the other's update
+    if (box.n_dpt_users.fetch_sub(1) == 1 && box.dpt_closing.load()) {
+      std::lock_guard<std::mutex> guard(box.dpt_users_mutex);
+      box.dpt_users_cv.notify_all();
+    }
+  }
+
+private:
+  cbasebox &box;
+};
+
+cbasebox::cbasebox(
+    rofcore::nbi *nbi,
+    const rofl::openflow::cofhello_elem_versionbitmap &versionbitmap,
+    const punt_policer_config &policer_cfg, unsigned int n_workers)
+    : nbi(nbi), policer(policer_cfg), n_dpt_users(0), dpt_closing(false),
+      packet_in_handlers() {
+  // source MAC learning is not implemented, the handler only logs and is
+  // not worth a copy of the frame for the workers
+  register_packet_in(OFDPA_FLOW_TABLE_ID_SA_LOOKUP,
+                     &cbasebox::handle_srcmac_table, false);
+  register_packet_in(OFDPA_FLOW_TABLE_ID_ACL_POLICY,
+                     &cbasebox::handle_acl_policy_table, false);
+
+  if (n_workers) {
+    workers.reset(new worker_pool<packet_in>(
+        n_workers, max_queued_packet_ins,
+        [this](packet_in &pin) { dispatch_packet_in(pin); }));
+  }
+
+  nbi->register_switch(this);
+  rofl::crofbase::set_versionbitmap(versionbitmap);
+}
+
+cbasebox::~cbasebox() { workers.reset(); }
+
+void cbasebox::register_packet_in(uint8_t table_id, packet_in_handler handler,
+                                  bool slow_path) {
+  for (auto &entry : packet_in_handlers[table_id]) {
+    entry.handler = handler;
+    entry.slow_path = slow_path;
+  }
+}
+
+void cbasebox::dispatch_packet_in(packet_in &pin) {
+  const packet_in_entry &entry = packet_in_handlers[pin.table_id][pin.reason];
+  (this->*entry.handler)(pin);
+}
+
 void cbasebox::handle_dpt_open(rofl::crofdpt &dpt) {
 
   std::lock_guard<std::mutex> lock(conn_mutex);
@@ -47,6 +113,22 @@ void cbasebox::handle_dpt_close(const rofl::cdptid &dptid) {
   LOG(INFO) << __FUNCTION__ << ": closing connection to dptid=0x" << std::hex
             << dptid << std::dec;
 
+  // stop packet-outs before the datapath goes away, the ones that already
+  // picked up the datapath from the old table are still sending
+  reset_port_table(nullptr, nullptr);
+  dpt_closing.store(true);
+  {
+    std::unique_lock<std::mutex> users_lock(dpt_users_mutex);
+    while (not dpt_users_cv.wait_for(users_lock, dpt_close_timeout, [this]() {
+      return n_dpt_users.load() == 0;
+    })) {
+      LOG(WARNING) << __FUNCTION__ << ": still waiting for "
+                   << n_dpt_users.load() << " packet-outs to dptid=0x"
+                   << std::hex << dptid << std::dec;
+    }
+  }
+  dpt_closing.store(false);
+
   std::deque<nbi::port_notification_data> ntfys;
   try {
     // TODO check this->dptid and dptid?
@@ -72,9 +154,20 @@ void cbasebox::handle_dpt_close(const rofl::cdptid &dptid) {
   this->dptid = rofl::cdptid(0);
 }
 
+void cbasebox::handle_conn_established(rofl::crofdpt &dpt,
+                                       const rofl::cauxid &auxid) {
+  // ports known from before the connection was lost, refreshed once the
+  // port description arrived
+  if (dpt.is_established())
+    reset_port_table(&dpt, &dpt.get_ports());
+}
+
 void cbasebox::handle_conn_terminated(rofl::crofdpt &dpt,
                                       const rofl::cauxid &auxid) {
-  LOG(WARNING) << __FUNCTION__ << ": XXX not implemented";
+  LOG(WARNING) << __FUNCTION__ << ": connection to dptid=0x" << std::hex
+               << dpt.get_dptid() << std::dec << " terminated";
+  if (not dpt.is_established())
+    reset_port_table(nullptr, nullptr);
 }
 
 void cbasebox::handle_conn_refused(rofl::crofdpt &dpt,
@@ -128,16 +221,50 @@ void cbasebox::handle_packet_in(rofl::crofdpt &dpt, const rofl::cauxid &auxid,
   }
 #endif
 
-  switch (msg.get_table_id()) {
-  case OFDPA_FLOW_TABLE_ID_SA_LOOKUP:
-    this->handle_srcmac_table(dpt, msg);
-    break;
+  packet_in pin;
+  pin.table_id = msg.get_table_id();
+  pin.reason = msg.get_reason();
+  if (pin.reason >= n_packet_in_reasons) {
+    return;
+  }
+  const packet_in_entry &entry = packet_in_handlers[pin.table_id][pin.reason];
+  if (entry.handler == nullptr) {
+    return;
+  }
 
-  case OFDPA_FLOW_TABLE_ID_ACL_POLICY:
-    this->handle_acl_policy_table(dpt, msg);
-    break;
-  default:
-    break;
+  try {
+    pin.in_port = msg.get_match().get_in_port();
+  } catch (rofl::openflow::eOxmNotFound &e) {
+    LOG(ERROR) << __FUNCTION__ << ": packet-in without in_port";
+    return;
+  }
+
+  const rofl::cpacket &pkt_in = msg.get_packet();
+  if (not entry.slow_path || not workers) {
+    // handled before the message buffer is released
+    pin.frame = pkt_in.soframe();
+    pin.len = pkt_in.length();
+    dispatch_packet_in(pin);
+    return;
+  }
+
+  pin.pkt = rofcore::cpacketpool::get_instance().try_acquire_pkt(
+      pkt_in.length());
+  if (not pin.pkt) {
+    LOG_EVERY_N(ERROR, 1000) << __FUNCTION__
+                             << ": packet pool exhausted, dropped "
+                             << google::COUNTER << " packet-ins";
+    return;
+  }
+  pin.pkt->unpack(pkt_in.soframe(), pkt_in.length());
+  pin.frame = pin.pkt->soframe();
+  pin.len = pin.pkt->length();
+
+  // packet-ins of a port stay in order
+  if (not workers->submit(pin.in_port, std::move(pin))) {
+    LOG_EVERY_N(WARNING, 1000) << __FUNCTION__
+                               << ": workers busy, dropped "
+                               << google::COUNTER << " packet-ins";
   }
 }
 
@@ -186,6 +313,7 @@ void cbasebox::handle_port_status(rofl::crofdpt &dpt, const rofl::cauxid &auxid,
 
   switch (msg.get_reason()) {
   case rofl::openflow::OFPPR_MODIFY: {
+    update_port_table(dpt, msg.get_port(), false);
 
     try {
       this->nbi->port_status_changed(port_no, status);
@@ -195,6 +323,7 @@ void cbasebox::handle_port_status(rofl::crofdpt &dpt, const rofl::cauxid &auxid,
     }
   } break;
   case rofl::openflow::OFPPR_ADD:
+    update_port_table(dpt, msg.get_port(), false);
     ntfys.emplace_back(nbi::port_notification_data{nbi::PORT_EVENT_ADD, port_no,
                                                    msg.get_port().get_name()});
     this->nbi->port_notification(ntfys);
@@ -204,6 +333,8 @@ void cbasebox::handle_port_status(rofl::crofdpt &dpt, const rofl::cauxid &auxid,
     ntfys.emplace_back(nbi::port_notification_data{nbi::PORT_EVENT_DEL, port_no,
                                                    msg.get_port().get_name()});
     this->nbi->port_notification(ntfys);
+    update_port_table(dpt, msg.get_port(), true);
+    policer.remove_port(port_no);
     break;
   default:
     LOG(ERROR) << __FUNCTION__ << ": invalid port status";
@@ -250,6 +381,8 @@ void cbasebox::handle_port_desc_stats_reply(
     stats.emplace_back(port.get_port_no(), status);
   }
 
+  reset_port_table(&dpt, &msg.get_ports());
+
   /* init 1:1 port mapping */
   try {
     this->nbi->port_notification(notifications);
@@ -293,8 +426,7 @@ void cbasebox::handle_experimenter_message(
   }
 }
 
-void cbasebox::handle_srcmac_table(rofl::crofdpt &dpt,
-                                   rofl::openflow::cofmsg_packet_in &msg) {
+void cbasebox::handle_srcmac_table(packet_in &pin) {
 #if 0 // XXX FIXME currently disabled
   using rofl::openflow::cofport;
   using rofcore::cnetlink;
@@ -338,34 +470,29 @@ void cbasebox::handle_srcmac_table(rofl::crofdpt &dpt,
   LOG(WARNING) << ": not implemented";
 }
 
-void cbasebox::handle_acl_policy_table(rofl::crofdpt &dpt,
-                                       rofl::openflow::cofmsg_packet_in &msg) {
-  using rofl::openflow::cofport;
-  using rofcore::cpacketpool;
-
-  rofl::cpacket *pkt = nullptr;
-  try {
-    const cofport &port =
-        dpt.get_ports().get_port(msg.get_match().get_in_port());
-
-    pkt = cpacketpool::get_instance().acquire_pkt();
-    const rofl::cpacket &pkt_in = msg.get_packet();
+void cbasebox::handle_acl_policy_table(packet_in &pin) {
+  std::shared_ptr<const port_table> ports = std::atomic_load(&port_tbl);
+  if (not ports || ports->find(pin.in_port) == nullptr) {
+    LOG(ERROR) << __FUNCTION__ << ": invalid in_port=" << pin.in_port;
+    return;
+  }
 
-    pkt->unpack(pkt_in.soframe(), pkt_in.length());
+  enum rofcore::pkt_class cls = rofcore::classify_frame(pin.frame, pin.len);
+  if (not policer.conform(pin.in_port, cls)) {
+    LOG_EVERY_N(WARNING, 1000) << __FUNCTION__ << ": rate exceeded on port "
+                               << pin.in_port << ", dropped "
+                               << google::COUNTER << " packet-ins";
+    return;
+  }
 
-    nbi->enqueue(port.get_port_no(), pkt);
-  } catch (rofcore::ePacketPoolExhausted &e) {
-    LOG(ERROR) << __FUNCTION__ << " ePacketPoolExhausted: " << e.what();
-  } catch (std::out_of_range &e) {
-    LOG(ERROR) << __FUNCTION__ << ": invalid range";
-    if (pkt) {
-      cpacketpool::get_instance().release_pkt(pkt);
-    }
-  } catch (std::exception &e) {
-    LOG(ERROR) << __FUNCTION__ << " exception: " << e.what();
-    if (pkt) {
-      cpacketpool::get_instance().release_pkt(pkt);
-    }
+  // the frame is written to the tap straight from the message buffer unless
+  // it was already copied for a worker
+  int rv = pin.pkt ? nbi->enqueue(pin.in_port, std::move(pin.pkt))
+                   : nbi->enqueue(pin.in_port, pin.frame, pin.len);
+  if (rv == -ENOBUFS) {
+    LOG_EVERY_N(ERROR, 1000) << __FUNCTION__
+                             << ": packet pool exhausted, dropped "
+                             << google::COUNTER << " packet-ins";
   }
 }
 
@@ -408,76 +535,258 @@ void cbasebox::handle_bridging_table_rm(
   LOG(WARNING) << ": not implemented";
 }
 
-int cbasebox::enqueue(uint32_t port_id, rofl::cpacket *pkt) noexcept {
-  using rofl::openflow::cofport;
-  using std::map;
+int cbasebox::enqueue(uint32_t port_id, rofcore::packet_ptr pkt) noexcept {
+  assert(pkt && "invalid enque");
+
+  // pkt is returned to the pool when going out of scope
+  return send_to_port(port_id, *pkt);
+}
+
+int cbasebox::flood(const std::vector<uint32_t> &port_ids,
+                    rofcore::packet_ptr pkt) noexcept {
   int rv = 0;
 
-  assert(pkt && "invalid enque");
-  struct ethhdr *eth = (struct ethhdr *)pkt->soframe();
+  assert(pkt && "invalid flood");
+  uint32_t group_id;
+  if (not flood_group_for(port_ids, *pkt, group_id)) {
+    // not flooded to all members of a VLAN, send a copy to each port
+    for (auto port_id : port_ids) {
+      int err = send_to_port(port_id, *pkt);
+      if (err < 0)
+        rv = err;
+    }
+    return rv;
+  }
+
+  dpt_user user(*this);
+  std::shared_ptr<const port_table> ports = std::atomic_load(&port_tbl);
+  if (not ports) {
+    LOG(WARNING) << __FUNCTION__ << " not connected, dropping packet";
+    return -ENOTCONN;
+  }
+
+  VLOG(3) << __FUNCTION__ << ": send packet out to group_id=0x" << std::hex
+          << group_id << std::dec << " instead of " << port_ids.size()
+          << " ports";
+
+  try {
+    rofl::openflow::cofactions actions(ports->dpt->get_version());
+    actions.set_action_group(rofl::cindex(0)).set_group_id(group_id);
+    rv = send_packet_out(*ports->dpt, actions, *pkt);
+  } catch (rofl::eRofConnNotConnected &e) {
+    LOG(ERROR) << __FUNCTION__ << ": not connected msg=" << e.what();
+    rv = -ENOTCONN;
+  } catch (std::exception &e) {
+    LOG(ERROR) << __FUNCTION__ << ": packet-out failed: " << e.what();
+    rv = -EINVAL;
+  }
+  return rv;
+}
+
+int cbasebox::send_to_port(uint32_t port_id, rofcore::packet &pkt) noexcept {
+  struct ethhdr *eth = (struct ethhdr *)pkt.soframe();
 
   if (eth->h_dest[0] == 0x33 && eth->h_dest[1] == 0x33) {
     VLOG(1) << __FUNCTION__ << ": drop multicast packet";
-    rv = -ENOTSUP;
-    goto errout;
+    return -ENOTSUP;
+  }
+
+  dpt_user user(*this);
+  std::shared_ptr<const port_table> ports = std::atomic_load(&port_tbl);
+  if (not ports) {
+    LOG(WARNING) << __FUNCTION__ << " not connected, dropping packet";
+    return -ENOTCONN;
+  }
+
+  /* only send packet-out if the port with port_id is actually existing */
+  const port_table::entry *port = ports->find(port_id);
+  if (port == nullptr) {
+    LOG(ERROR) << __FUNCTION__ << ": packet sent to invalid port_id "
+               << port_id;
+    return -EINVAL;
+  }
+  if (not port->link_up) {
+    VLOG(3) << __FUNCTION__ << ": port_id=" << port_id
+            << " is down, dropping packet";
+    return -ENETDOWN;
+  }
+
+  if (VLOG_IS_ON(3)) {
+    char src_mac[32];
+    char dst_mac[32];
+
+    snprintf(dst_mac, sizeof(dst_mac), "%02X:%02X:%02X:%02X:%02X:%02X",
+             eth->h_dest[0], eth->h_dest[1], eth->h_dest[2], eth->h_dest[3],
+             eth->h_dest[4], eth->h_dest[5]);
+    snprintf(src_mac, sizeof(src_mac), "%02X:%02X:%02X:%02X:%02X:%02X",
+             eth->h_source[0], eth->h_source[1], eth->h_source[2],
+             eth->h_source[3], eth->h_source[4], eth->h_source[5]);
+
+    VLOG(3) << __FUNCTION__ << ": send packet out to port_id=" << port_id
+            << " eth.dst=" << std::string(dst_mac)
+            << " eth.src=" << std::string(src_mac)
+            << " called from tid=" << pthread_self();
   }
 
   try {
-    rofl::crofdpt &dpt = set_dpt(this->dptid, true);
-    if (not dpt.is_established()) {
-      LOG(WARNING) << __FUNCTION__ << " not connected, dropping packet";
-      rv = -ENOTCONN;
-      goto errout;
+    return send_packet_out(*ports->dpt, port->actions, pkt);
+  } catch (rofl::eRofConnNotConnected &e) {
+    LOG(ERROR) << __FUNCTION__ << ": not connected msg=" << e.what();
+    return -ENOTCONN;
+  } catch (std::exception &e) {
+    LOG(ERROR) << __FUNCTION__ << ": packet-out failed: " << e.what();
+    return -EINVAL;
+  }
+}
+
+int cbasebox::send_packet_out(rofl::crofdpt &dpt,
+                              const rofl::openflow::cofactions &actions,
+                              rofcore::packet &pkt) {
+  // XXX rofl serializes the message into a buffer of its own, the
+  // headroom of pkt is left for finishing the packet-out in place
+  auto packet_out = [&](uint8_t *frame, size_t len) {
+    dpt.send_packet_out_message(
+        rofl::cauxid(0),
+        rofl::openflow::base::get_ofp_no_buffer(dpt.get_version()),
+        rofl::openflow::base::get_ofpp_controller_port(dpt.get_version()),
+        actions, frame, len);
+  };
+
+  // offloads of the tap are finished here, once per frame sent out
+  if (rofcore::gso_needed(pkt)) {
+    std::vector<uint8_t> seg;
+    int n = rofcore::gso_segment(pkt, seg, packet_out);
+    if (n < 0) {
+      LOG(ERROR) << __FUNCTION__ << ": failed to segment GSO frame of "
+                 << pkt.length() << " bytes";
+      return n;
     }
+    VLOG(3) << __FUNCTION__ << ": sent " << n << " segments";
+  } else if (rofcore::csum_complete(pkt)) {
+    packet_out(pkt.soframe(), pkt.length());
+  } else {
+    LOG(ERROR) << __FUNCTION__
+               << ": dropping frame with invalid checksum offload";
+    return -EINVAL;
+  }
+  return 0;
+}
 
-    /* only send packet-out if the port with port_id is actually existing */
-    if (dpt.get_ports().has_port(port_id)) {
+void cbasebox::port_table::set(rofl::crofdpt &dpt,
+                               const rofl::openflow::cofport &port) {
+  uint32_t port_id = port.get_port_no();
+  entry &e = ports.set(port_id);
+  e.link_up = not(port.get_config() & rofl::openflow13::OFPPC_PORT_DOWN) &&
+              not(port.get_state() & rofl::openflow13::OFPPS_LINK_DOWN);
+  e.actions = rofl::openflow::cofactions(dpt.get_version());
+  e.actions.set_action_output(rofl::cindex(0)).set_port_no(port_id);
+}
 
-      char src_mac[32];
-      char dst_mac[32];
+void cbasebox::reset_port_table(rofl::crofdpt *dpt,
+                                const rofl::openflow::cofports *ports) {
+  std::shared_ptr<port_table> tbl;
+  if (dpt) {
+    tbl = std::make_shared<port_table>();
+    tbl->dpt = dpt;
+    for (auto i : ports->keys()) {
+      tbl->set(*dpt, ports->get_port(i));
+    }
+  }
 
-      if (VLOG_IS_ON(3)) {
-        snprintf(dst_mac, sizeof(dst_mac), "%02X:%02X:%02X:%02X:%02X:%02X",
-                 eth->h_dest[0], eth->h_dest[1], eth->h_dest[2], eth->h_dest[3],
-                 eth->h_dest[4], eth->h_dest[5]);
-        snprintf(src_mac, sizeof(src_mac), "%02X:%02X:%02X:%02X:%02X:%02X",
-                 eth->h_source[0], eth->h_source[1], eth->h_source[2],
-                 eth->h_source[3], eth->h_source[4], eth->h_source[5]);
-      }
+  std::lock_guard<std::mutex> lock(port_tbl_mutex);
+  std::atomic_store(&port_tbl, std::shared_ptr<const port_table>(tbl));
+}
 
-      VLOG(3) << __FUNCTION__ << ": send packet out to port_id=" << port_id
-              << " eth.dst=" << std::string(dst_mac)
-              << " eth.src=" << std::string(src_mac)
-              << " called from tid=" << pthread_self();
+void cbasebox::update_port_table(rofl::crofdpt &dpt,
+                                 const rofl::openflow::cofport &port,
+                                 bool remove) {
+  std::lock_guard<std::mutex> lock(port_tbl_mutex);
+  std::shared_ptr<const port_table> cur = std::atomic_load(&port_tbl);
+  if (not cur || cur->dpt != &dpt) {
+    // not connected, the table is built from the port description
+    return;
+  }
+
+  // copied, readers may still use the current table
+  std::shared_ptr<port_table> tbl = std::make_shared<port_table>(*cur);
+  if (remove) {
+    tbl->erase(port.get_port_no());
+  } else {
+    tbl->set(dpt, port);
+  }
+  std::atomic_store(&port_tbl, std::shared_ptr<const port_table>(tbl));
+}
 
-      rofl::openflow::cofactions actions(dpt.get_version());
-      actions.set_action_output(rofl::cindex(0)).set_port_no(port_id);
+void cbasebox::set_flood_member(uint16_t vid, uint32_t port, bool untagged,
+                                bool member) {
+  std::lock_guard<std::mutex> lock(flood_mutex);
+  if (member) {
+    vlan_ports[vid][port] = untagged;
+  } else {
+    vlan_ports[vid].erase(port);
+    if (vlan_ports[vid].empty())
+      vlan_ports.erase(vid);
+  }
 
-      dpt.send_packet_out_message(
-          rofl::cauxid(0),
-          rofl::openflow::base::get_ofp_no_buffer(dpt.get_version()),
-          rofl::openflow::base::get_ofpp_controller_port(dpt.get_version()),
-          actions, pkt->soframe(), pkt->length());
-    } else {
-      LOG(ERROR) << __FUNCTION__ << ": packet sent to invalid port_id "
-                 << port_id;
+  // the group is replaced, see egress_port_vlan_add()
+  flood_groups.erase(vid);
+}
+
+void cbasebox::set_flood_group(uint16_t vid, uint32_t group_id) {
+  std::lock_guard<std::mutex> lock(flood_mutex);
+  flood_groups[vid] = group_id;
+}
+
+bool cbasebox::flood_group_for(const std::vector<uint32_t> &port_ids,
+                               rofcore::packet &pkt, uint32_t &group_id) {
+  struct vlan_hdr *hdr = (struct vlan_hdr *)pkt.soframe();
+  bool tagged = pkt.length() >= sizeof(struct vlan_hdr) &&
+                ETH_P_8021Q == be16toh(hdr->eth.h_proto);
+  uint16_t vid = 0;
+
+  std::lock_guard<std::mutex> lock(flood_mutex);
+  if (tagged) {
+    vid = be16toh(hdr->vlan) & 0xfff;
+  } else {
+    // untagged frames belong to the VLAN the ports are untagged members of
+    for (auto &v : vlan_ports) {
+      auto p = v.second.find(port_ids.front());
+      if (p != v.second.end() && p->second) {
+        vid = v.first;
+        break;
+      }
     }
-  } catch (rofl::eRofDptNotFound &e) {
-    LOG(ERROR) << __FUNCTION__
-               << ": no data path attached, dropping outgoing packet";
-    rv = -ENOTCONN;
-  } catch (rofl::eRofBaseNotFound &e) {
-    LOG(ERROR) << __FUNCTION__ << ": " << e.what();
-    rv = -EINVAL;
-  } catch (rofl::openflow::ePortsNotFound &e) {
-    LOG(ERROR) << __FUNCTION__ << ": invalid port for packet out";
-    rv = -EINVAL;
   }
 
-errout:
+  // the group floods to all members, the frame must have been written to
+  // exactly those with the tagging the group applies
+  auto vlan = vlan_ports.find(vid);
+  auto group = flood_groups.find(vid);
+  if (vlan == vlan_ports.end() || group == flood_groups.end() ||
+      vlan->second.size() != port_ids.size()) {
+    return false;
+  }
+  for (auto port_id : port_ids) {
+    auto p = vlan->second.find(port_id);
+    if (p == vlan->second.end() || p->second == tagged) {
+      return false;
+    }
+  }
 
-  rofcore::cpacketpool::get_instance().release_pkt(pkt);
-  return rv;
+  if (not tagged) {
+    // the L2 interface groups of untagged members pop the tag again
+    if (pkt.headroom() < vlan_tag_len) {
+      return false;
+    }
+    uint8_t *frame = pkt.push(vlan_tag_len);
+    memmove(frame, frame + vlan_tag_len, 2 * ETH_ALEN);
+    hdr = (struct vlan_hdr *)frame;
+    hdr->eth.h_proto = htobe16(ETH_P_8021Q);
+    hdr->vlan = htobe16(vid);
+  }
+
+  group_id = group->second;
+  return true;
 }
 
 int cbasebox::l2_addr_remove_all_in_vlan(uint32_t port, uint16_t vid) noexcept {
@@ -667,6 +976,7 @@ int cbasebox::egress_port_vlan_add(uint32_t port, uint16_t vid,
     l2_domain[vid].insert(group_id);
 
     // remove old L2 flooding group
+    set_flood_member(vid, port, untagged, true);
     fm_driver.remove_bridging_dlf_vlan(dpt, vid);
     dpt.send_barrier_request(rofl::cauxid(0));
     fm_driver.disable_group_l2_flood(dpt, vid, vid);
@@ -677,6 +987,7 @@ int cbasebox::egress_port_vlan_add(uint32_t port, uint16_t vid,
     dpt.send_barrier_request(rofl::cauxid(0));
     fm_driver.add_bridging_dlf_vlan(dpt, vid, group_id);
     dpt.send_barrier_request(rofl::cauxid(0));
+    set_flood_group(vid, group_id);
   } catch (rofl::eRofBaseNotFound &e) {
     LOG(ERROR) << ": caught rofl::eRofBaseNotFound";
     rv = -EINVAL;
@@ -699,6 +1010,7 @@ int cbasebox::egress_port_vlan_remove(uint32_t port, uint16_t vid,
     l2_domain[vid].erase(group_id);
 
     // remove old L2 flooding group
+    set_flood_member(vid, port, untagged, false);
     fm_driver.remove_bridging_dlf_vlan(dpt, vid);
     dpt.send_barrier_request(rofl::cauxid(0));
     fm_driver.disable_group_l2_flood(dpt, vid, vid);
@@ -710,6 +1022,7 @@ int cbasebox::egress_port_vlan_remove(uint32_t port, uint16_t vid,
       dpt.send_barrier_request(rofl::cauxid(0));
       fm_driver.add_bridging_dlf_vlan(dpt, vid, group_id);
       dpt.send_barrier_request(rofl::cauxid(0));
+      set_flood_group(vid, group_id);
     }
 
     // remove filtered egress interface
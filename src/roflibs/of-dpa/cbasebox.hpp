@@ -8,18 +8,26 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <exception>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <glog/logging.h>
 #include <rofl/common/crofbase.h>
 #include <rofl/common/crofdpt.h>
 #include <rofl/ofdpa/rofl_ofdpa_fm_driver.hpp>
 
+#include "roflibs/netlink/port_index.hpp"
 #include "roflibs/netlink/sai.hpp"
+#include "roflibs/of-dpa/punt_policer.hpp"
+#include "roflibs/of-dpa/worker_pool.hpp"
 
 namespace basebox {
 
@@ -48,19 +56,21 @@ class cbasebox : public rofl::crofbase,
   cbasebox &operator=(const cbasebox &) = delete;
 
 public:
+  /**
+   * @param n_workers threads running the slow path packet-in handlers, 0
+   * runs them on the OpenFlow thread
+   */
   cbasebox(rofcore::nbi *nbi,
            const rofl::openflow::cofhello_elem_versionbitmap &versionbitmap =
-               rofl::openflow::cofhello_elem_versionbitmap())
-      : nbi(nbi) {
-    nbi->register_switch(this);
-    rofl::crofbase::set_versionbitmap(versionbitmap);
-  }
+               rofl::openflow::cofhello_elem_versionbitmap(),
+           const punt_policer_config &policer_cfg = punt_policer_config(),
+           unsigned int n_workers = 1);
 
-  ~cbasebox() override {}
+  ~cbasebox() override;
 
 protected:
   void handle_conn_established(rofl::crofdpt &dpt,
-                               const rofl::cauxid &auxid) override {}
+                               const rofl::cauxid &auxid) override;
 
   void handle_dpt_open(rofl::crofdpt &dpt) override;
 
@@ -138,10 +148,20 @@ public:
                               bool untagged) noexcept override;
 
   /* IO */
-  int enqueue(uint32_t port_id, rofl::cpacket *pkt) noexcept override;
+  int enqueue(uint32_t port_id, rofcore::packet_ptr pkt) noexcept override;
+  int flood(const std::vector<uint32_t> &port_ids,
+            rofcore::packet_ptr pkt) noexcept override;
 
   int subscribe_to(enum swi_flags flags) noexcept override;
 
+  /* packet-ins passed and dropped by the punt policer */
+  punt_policer::stats get_punt_stats() { return policer.get_stats(); }
+
+  /* slow path packet-ins dropped because their worker's queue was full */
+  uint64_t get_packet_in_dropped() {
+    return workers ? workers->get_dropped() : 0;
+  }
+
   /* print this */
   friend std::ostream &operator<<(std::ostream &os, const cbasebox &box) {
     os << "<cbasebox>" << std::endl;
@@ -153,16 +173,117 @@ private:
   rofl::rofl_ofdpa_fm_driver fm_driver;
   std::map<uint16_t, std::set<uint32_t>> l2_domain;
   std::mutex conn_mutex;
+  punt_policer policer;
+
+  /**
+   * ports of the datapath as needed for packet-out
+   *
+   * The table is rebuilt on port and connection events and replaced as a
+   * whole, so the tap_io threads look up ports without locks, exceptions or
+   * going through crofbase.
+   */
+  struct port_table {
+    struct entry {
+      entry() : link_up(false) {}
+      bool link_up;
+      rofl::openflow::cofactions actions; // output to the port
+    };
+
+    port_table() : dpt(nullptr) {}
+
+    // only set while the connection is established, must only be used
+    // while counted in n_dpt_users
+    rofl::crofdpt *dpt;
+    rofcore::port_index<entry> ports;
+
+    const entry *find(uint32_t port_id) const { return ports.find(port_id); }
+    void set(rofl::crofdpt &dpt, const rofl::openflow::cofport &port);
+    void erase(uint32_t port_id) { ports.erase(port_id); }
+  };
+  std::mutex port_tbl_mutex; // serializes updates
+  std::shared_ptr<const port_table> port_tbl;
+  // threads sending through port_tbl->dpt, handle_dpt_close() waits for them
+  // before the datapath goes away. The last one notifies dpt_users_cv while
+  // dpt_closing is set.
+  std::atomic<unsigned int> n_dpt_users;
+  std::atomic<bool> dpt_closing;
+  std::mutex dpt_users_mutex;
+  std::condition_variable dpt_users_cv;
+  class dpt_user;
+
+  void reset_port_table(rofl::crofdpt *dpt,
+                        const rofl::openflow::cofports *ports);
+  void update_port_table(rofl::crofdpt &dpt,
+                         const rofl::openflow::cofport &port, bool remove);
+
+  // egress ports of each VLAN (true if untagged) and the VLAN's flood group,
+  // kept for sending frames flooded by the kernel with a single packet-out
+  std::mutex flood_mutex;
+  std::map<uint16_t, std::map<uint32_t, bool>> vlan_ports;
+  std::map<uint16_t, uint32_t> flood_groups;
+
+  int send_to_port(uint32_t port_id, rofcore::packet &pkt) noexcept;
+  int send_packet_out(rofl::crofdpt &dpt,
+                      const rofl::openflow::cofactions &actions,
+                      rofcore::packet &pkt);
+
+  void set_flood_member(uint16_t vid, uint32_t port, bool untagged,
+                        bool member);
+  void set_flood_group(uint16_t vid, uint32_t group_id);
+
+  /**
+   * @brief find the flood group of the VLAN whose members are port_ids
+   *
+   * Untagged frames are tagged for the group, the L2 interface groups of
+   * untagged members strip the tag again.
+   *
+   * @return false in case port_ids are not exactly the members of a VLAN
+   */
+  bool flood_group_for(const std::vector<uint32_t> &port_ids,
+                       rofcore::packet &pkt, uint32_t &group_id);
 
   /* OF handler */
-  void handle_srcmac_table(rofl::crofdpt &dpt,
-                           rofl::openflow::cofmsg_packet_in &msg);
 
-  void handle_acl_policy_table(rofl::crofdpt &dpt,
-                               rofl::openflow::cofmsg_packet_in &msg);
+  // a packet-in as seen by the handlers registered for it
+  struct packet_in {
+    uint32_t in_port;
+    uint8_t table_id;
+    uint8_t reason;
+    const uint8_t *frame; // in the message or in pkt
+    size_t len;
+    rofcore::packet_ptr pkt; // copy of the frame for the worker threads
+  };
+
+  typedef void (cbasebox::*packet_in_handler)(packet_in &pin);
+
+  struct packet_in_entry {
+    packet_in_handler handler;
+    bool slow_path; // run on the worker threads
+  };
+
+  // reasons of OpenFlow 1.3 are 0 to 2
+  static const unsigned int n_packet_in_reasons = 4;
+  packet_in_entry packet_in_handlers[256][n_packet_in_reasons];
+
+  /**
+   * @brief run handler for packet-ins from table_id for any reason
+   *
+   * Slow path handlers must not assume to run on the OpenFlow thread.
+   */
+  void register_packet_in(uint8_t table_id, packet_in_handler handler,
+                          bool slow_path);
+  void dispatch_packet_in(packet_in &pin);
+
+  void handle_srcmac_table(packet_in &pin);
+
+  void handle_acl_policy_table(packet_in &pin);
 
   void handle_bridging_table_rm(rofl::crofdpt &dpt,
                                 rofl::openflow::cofmsg_flow_removed &msg);
+
+  // stopped first on destruction, handlers use the members above
+  static const size_t max_queued_packet_ins = 1024; // per worker
+  std::unique_ptr<worker_pool<packet_in>> workers;
 }; // class cbasebox
 
 } // end of namespace basebox
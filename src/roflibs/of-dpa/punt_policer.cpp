@@ -0,0 +1,65 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <algorithm>
+
+#include "roflibs/of-dpa/punt_policer.hpp"
+
+namespace basebox {
+
+bool punt_policer::conform(uint32_t port_id, enum rofcore::pkt_class cls) {
+  std::lock_guard<std::mutex> guard(mutex);
+
+  if (cfg.rate[cls] == 0) {
+    totals.passed[cls]++;
+    return true;
+  }
+
+  clock::time_point now = clock::now();
+  auto it = ports.find(port_id);
+  if (it == ports.end()) {
+    // new ports start with a full bucket
+    it = ports.emplace(port_id, port_buckets()).first;
+    for (unsigned int c = 0; c < rofcore::n_pkt_classes; c++) {
+      it->second.b[c].tokens = std::max(cfg.burst[c], 1U);
+      it->second.b[c].last = now;
+    }
+  }
+
+  bucket &b = it->second.b[cls];
+  std::chrono::duration<double> elapsed = now - b.last;
+  b.tokens = std::min(b.tokens + elapsed.count() * cfg.rate[cls],
+                      (double)std::max(cfg.burst[cls], 1U));
+  b.last = now;
+
+  if (b.tokens < 1.0) {
+    totals.dropped[cls]++;
+    return false;
+  }
+  b.tokens -= 1.0;
+  totals.passed[cls]++;
+  return true;
+}
+
+void punt_policer::remove_port(uint32_t port_id) {
+  std::lock_guard<std::mutex> guard(mutex);
+  ports.erase(port_id);
+}
+
+punt_policer::stats punt_policer::get_stats() {
+  std::lock_guard<std::mutex> guard(mutex);
+  return totals;
+}
+
+std::ostream &operator<<(std::ostream &os, const punt_policer::stats &s) {
+  for (unsigned int c = 0; c < rofcore::n_pkt_classes; c++) {
+    os << (c ? " " : "") << rofcore::pkt_class_name((enum rofcore::pkt_class)c)
+       << "_passed=" << s.passed[c] << " "
+       << rofcore::pkt_class_name((enum rofcore::pkt_class)c)
+       << "_dropped=" << s.dropped[c];
+  }
+  return os;
+}
+
+} // namespace basebox
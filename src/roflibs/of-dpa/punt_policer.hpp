@@ -0,0 +1,78 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+
+#include "roflibs/netlink/pkt_class.hpp"
+
+namespace basebox {
+
+/**
+ * @brief rate limits of punted frames per port and traffic class
+ *
+ * A rate of 0 disables policing of the class.
+ */
+struct punt_policer_config {
+  punt_policer_config() : rate{0, 0}, burst{0, 0} {}
+
+  unsigned int rate[rofcore::n_pkt_classes];  // frames per second
+  unsigned int burst[rofcore::n_pkt_classes]; // bucket depth in frames
+};
+
+/**
+ * @brief token buckets limiting the packet-ins injected into the taps
+ *
+ * Frames exceeding the rate of their port and class are dropped before a
+ * packet buffer or a tap queue slot is taken for them.
+ */
+class punt_policer {
+public:
+  struct stats {
+    uint64_t passed[rofcore::n_pkt_classes];
+    uint64_t dropped[rofcore::n_pkt_classes];
+  };
+
+  explicit punt_policer(const punt_policer_config &cfg) : cfg(cfg), totals() {}
+
+  /**
+   * @brief take a token for a frame of class cls received on port_id
+   *
+   * @return false in case the frame has to be dropped
+   */
+  bool conform(uint32_t port_id, enum rofcore::pkt_class cls);
+
+  /**
+   * @brief release the buckets of a removed port
+   */
+  void remove_port(uint32_t port_id);
+
+  stats get_stats();
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  struct bucket {
+    double tokens;
+    clock::time_point last;
+  };
+
+  struct port_buckets {
+    bucket b[rofcore::n_pkt_classes];
+  };
+
+  const punt_policer_config cfg;
+  std::mutex mutex;
+  std::map<uint32_t, port_buckets> ports;
+  stats totals;
+};
+
+std::ostream &operator<<(std::ostream &os, const punt_policer::stats &s);
+
+} // namespace basebox
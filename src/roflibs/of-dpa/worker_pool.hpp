@@ -0,0 +1,111 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace basebox {
+
+/**
+ * @brief threads running a handler for submitted items
+ *
+ * Items with the same key are handled by the same thread in the order they
+ * were submitted. Each thread queues up to max_queued items, further ones are
+ * dropped. Items still queued on destruction are discarded.
+ */
+template <typename T> class worker_pool {
+public:
+  worker_pool(unsigned int n_threads, size_t max_queued,
+              std::function<void(T &)> handler)
+      : max_queued(max_queued), handler(handler), dropped(0) {
+    for (unsigned int i = 0; i < n_threads; i++) {
+      workers.emplace_back(new worker());
+    }
+    for (auto &w : workers) {
+      worker *wp = w.get();
+      w->thread = std::thread([this, wp]() { run(*wp); });
+    }
+  }
+
+  ~worker_pool() {
+    for (auto &w : workers) {
+      std::lock_guard<std::mutex> guard(w->mutex);
+      w->stopping = true;
+      w->cv.notify_one();
+    }
+    for (auto &w : workers) {
+      w->thread.join();
+    }
+  }
+
+  /**
+   * @return false in case the queue of the thread serving key is full
+   */
+  bool submit(uint32_t key, T &&item) {
+    worker &w = *workers[key % workers.size()];
+    {
+      std::lock_guard<std::mutex> guard(w.mutex);
+      if (w.items.size() >= max_queued) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      w.items.push_back(std::move(item));
+    }
+    w.cv.notify_one();
+    return true;
+  }
+
+  uint64_t get_dropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  worker_pool(const worker_pool &) = delete;
+  worker_pool &operator=(const worker_pool &) = delete;
+
+  struct worker {
+    worker() : stopping(false) {}
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<T> items;
+    bool stopping;
+    std::thread thread;
+  };
+
+  void run(worker &w) {
+    std::deque<T> batch;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(w.mutex);
+        w.cv.wait(lock, [&w]() { return w.stopping || not w.items.empty(); });
+        if (w.stopping)
+          return;
+        std::swap(batch, w.items);
+      }
+
+      // handled without the lock, submit() does not wait for slow handlers
+      for (auto &item : batch) {
+        handler(item);
+      }
+      batch.clear();
+    }
+  }
+
+  const size_t max_queued;
+  const std::function<void(T &)> handler;
+  std::atomic<uint64_t> dropped;
+  std::vector<std::unique_ptr<worker>> workers;
+};
+
+} // namespace basebox